@@ -18,7 +18,8 @@
 
 // Constructor
 Adafruit_ESP8266::Adafruit_ESP8266(Stream *s, Stream *d, int8_t r) :
- stream(s), debug(d), reset_pin(r), host(NULL), writing(false) {
+ stream(s), debug(d), reset_pin(r), host(NULL), writing(false),
+ idleStrategy(ESP_IDLE_SPIN), idleCallback(NULL), idleContext(NULL) {
   setTimeouts();
 };
 
@@ -39,6 +40,14 @@ void Adafruit_ESP8266::setBootMarker(Fstr *s) {
   bootMarker = s ? s : defaultBootMarker;
 }
 
+// Choose what find() does between polls of the stream (see EspIdle.h).
+void Adafruit_ESP8266::setIdle(uint8_t strategy,
+ EspIdleCallback callback, void *context) {
+  idleStrategy = strategy;
+  idleCallback = callback;
+  idleContext  = context;
+}
+
 // Anything printed to the EPS8266 object will be split to both the WiFi
 // and debug streams.  Saves having to print everything twice in debug code.
 size_t Adafruit_ESP8266::write(uint8_t c) {
@@ -91,6 +100,7 @@ boolean Adafruit_ESP8266::find(Fstr *str, boolean ipd) {
             t = millis();    // Timeout resets w/each byte received
           } else if(c < 0) { // No data on stream, check for timeout
             if((millis() - t) > receiveTimeout) goto bail;
+            espIdle(idleStrategy, idleCallback, idleContext);
           } else goto bail; // EOD on stream
         }
       } else break; // OK (EOD) or ERROR
@@ -111,6 +121,7 @@ boolean Adafruit_ESP8266::find(Fstr *str, boolean ipd) {
       t = millis();     // Timeout resets w/each byte received
     } else if(c < 0) {  // No data on stream, check for timeout
       if((millis() - t) > receiveTimeout) break; // You lose, good day sir
+      espIdle(idleStrategy, idleCallback, idleContext);
     } else break;       // End-of-data on stream
   }
 
@@ -18,6 +18,7 @@
 #define _ADAFRUIT_ESP8266_H_
 
 #include <Arduino.h>
+#include "EspIdle.h"
 
 #define ESP_RECEIVE_TIMEOUT   1000L
 #define ESP_RESET_TIMEOUT     5000L
@@ -50,7 +51,9 @@ class Adafruit_ESP8266 : public Print {
                         uint32_t rst = ESP_RESET_TIMEOUT,
                         uint32_t con = ESP_CONNECT_TIMEOUT,
                         uint32_t ipd = ESP_IPD_TIMEOUT),
-            setBootMarker(Fstr *s = NULL);
+            setBootMarker(Fstr *s = NULL),
+            setIdle(uint8_t strategy = ESP_IDLE_SPIN,
+                    EspIdleCallback callback = NULL, void *context = NULL);
  private:
   Stream   *stream,     // -> ESP8266, e.g. SoftwareSerial or Serial1
            *debug;      // -> host, e.g. Serial
@@ -59,6 +62,9 @@ class Adafruit_ESP8266 : public Print {
   Fstr     *host,       // Non-NULL when TCP connection open
            *bootMarker; // String indicating successful boot
   boolean   writing;
+  uint8_t   idleStrategy; // ESP_IDLE_* used while waiting for data
+  EspIdleCallback idleCallback;
+  void     *idleContext;
   virtual size_t write(uint8_t); // Because Print subclass
 };
 
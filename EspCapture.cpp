@@ -0,0 +1,265 @@
+/*------------------------------------------------------------------------
+Session capture and replay for SimpleESP8266
+
+MIT license, all text above must be included in any redistribution.
+------------------------------------------------------------------------*/
+
+#include "EspCapture.h"
+
+#define CAPTURE_TX            0x80     //Record tag bit: sent to the module
+
+static const char capture_magic[] PROGMEM = "ESPC";
+
+EspCaptureStream::EspCaptureStream(Stream *stream, Print *sink) :
+    stream_(stream), sink_(sink), started_(false), run_len_(0), run_tx_(false),
+    run_start_(0), last_start_(0)
+{
+}
+
+int EspCaptureStream::available()
+{
+    return stream_->available();
+}
+
+int EspCaptureStream::read()
+{
+    int c = stream_->read();
+    if (c >= 0)
+    {
+        record(false, c);
+    }
+    return c;
+}
+
+int EspCaptureStream::peek()
+{
+    return stream_->peek();
+}
+
+size_t EspCaptureStream::write(uint8_t c)
+{
+    record(true, c);
+    return stream_->write(c);
+}
+
+size_t EspCaptureStream::write(const uint8_t *buffer, size_t size)
+{
+    for (size_t i = 0; i < size; ++i)
+    {
+        record(true, buffer[i]);
+    }
+    return stream_->write(buffer, size);
+}
+
+int EspCaptureStream::availableForWrite()
+{
+    return stream_->availableForWrite();
+}
+
+// Also writes out the record in progress, so call it before closing the
+// capture file
+void EspCaptureStream::flush()
+{
+    endRun();
+    stream_->flush();
+}
+
+void EspCaptureStream::record(boolean tx, uint8_t c)
+{
+    uint32_t now = millis();
+    if (run_len_ > 0 && (tx != run_tx_ || run_len_ == sizeof(run_) || (now - run_start_) >= ESP_CAPTURE_TICK))
+    {
+        endRun();
+    }
+    if (run_len_ == 0)
+    {
+        run_tx_ = tx;
+        run_start_ = now;
+    }
+    run_[run_len_++] = c;
+}
+
+// Write the run collected so far as one record
+void EspCaptureStream::endRun()
+{
+    uint32_t delta;
+    if (run_len_ == 0)
+    {
+        return;
+    }
+    if (!started_)
+    {
+        for (uint8_t i = 0; i < sizeof(capture_magic) - 1; ++i)
+        {
+            sink_->write(pgm_read_byte(capture_magic + i));
+        }
+        sink_->write((uint8_t)ESP_CAPTURE_VERSION);
+        last_start_ = run_start_;
+        started_ = true;
+    }
+    delta = run_start_ - last_start_;
+    last_start_ = run_start_;
+    sink_->write((run_tx_ ? CAPTURE_TX : 0) | (run_len_ - 1));
+    while (delta >= 0x80)
+    {
+        sink_->write((uint8_t)((delta & 0x7F) | 0x80));
+        delta >>= 7;
+    }
+    sink_->write((uint8_t)delta);
+    sink_->write(run_, run_len_);
+    run_len_ = 0;
+}
+
+// speed divides the recorded delays (2 plays twice as fast); 0 plays the
+// module's output as soon as the library has sent what came before it
+EspReplayStream::EspReplayStream(Stream *capture, uint8_t speed) :
+    capture_(capture), speed_(speed), started_(false), tx_(false), left_(0),
+    due_(0), last_start_(0), tx_started_(false)
+{
+    memset(&stats_, 0, sizeof(stats_));
+}
+
+int EspReplayStream::available()
+{
+    return (ready() && !tx_) ? left_ : 0;
+}
+
+int EspReplayStream::read()
+{
+    if (!ready() || tx_)
+    {
+        return -1;
+    }
+    int c = captureByte();
+    stats_.rx_bytes++;
+    if (--left_ == 0)
+    {
+        nextRecord();
+    }
+    return c;
+}
+
+int EspReplayStream::peek()
+{
+    if (!ready() || tx_)
+    {
+        return -1;
+    }
+    return capture_->peek();
+}
+
+// The library is sending: check it against the capture.  Output the
+// capture doesn't expect (it's waiting to play module output, or has
+// ended) counts as a mismatch.
+size_t EspReplayStream::write(uint8_t c)
+{
+    stats_.tx_bytes++;
+    ready();
+    if (stats_.done || !tx_)
+    {
+        stats_.tx_mismatches++;
+        return 1;
+    }
+    if (!tx_started_)
+    {
+        //How late is the command compared with the recorded timing?
+        uint32_t now = millis();
+        uint32_t lag = (int32_t)(now - due_) > 0 ? now - due_ : 0;
+        if (lag > stats_.max_lag_ms)
+        {
+            stats_.max_lag_ms = lag;
+        }
+        stats_.total_lag_ms += lag;
+        last_start_ = now;
+        tx_started_ = true;
+    }
+    if (captureByte() != c)
+    {
+        stats_.tx_mismatches++;
+    }
+    if (--left_ == 0)
+    {
+        nextRecord();
+    }
+    return 1;
+}
+
+const EspReplayStats *EspReplayStream::stats()
+{
+    return &stats_;
+}
+
+// Returns true once the current record may be played: module output when
+// its time has come, library output at once
+boolean EspReplayStream::ready()
+{
+    if (!started_)
+    {
+        started_ = true;
+        last_start_ = millis();
+        for (uint8_t i = 0; i < sizeof(capture_magic) - 1; ++i)
+        {
+            if (captureByte() != pgm_read_byte(capture_magic + i))
+            {
+                stats_.bad_format = true;
+            }
+        }
+        if (captureByte() != ESP_CAPTURE_VERSION)
+        {
+            stats_.bad_format = true;
+        }
+        if (stats_.bad_format)
+        {
+            stats_.done = true;
+            return false;
+        }
+        nextRecord();
+    }
+    if (stats_.done)
+    {
+        return false;
+    }
+    if (!tx_ && !tx_started_ && (int32_t)(millis() - due_) >= 0)
+    {
+        //Module output starts when it's due; later records count from here
+        last_start_ = due_;
+        tx_started_ = true;
+    }
+    return tx_ || tx_started_;
+}
+
+// Read the next record's header and work out when it's due
+boolean EspReplayStream::nextRecord()
+{
+    int      tag = captureByte();
+    uint32_t delta = 0;
+    uint8_t  shift = 0;
+    int      c;
+    if (tag < 0)
+    {
+        stats_.done = true;
+        return false;
+    }
+    do
+    {
+        c = captureByte();
+        if (c < 0)
+        {
+            stats_.done = true;
+            return false;
+        }
+        delta |= (uint32_t)(c & 0x7F) << shift;
+        shift += 7;
+    } while (c & 0x80);
+    tx_ = (tag & CAPTURE_TX) != 0;
+    left_ = (tag & 0x7F) + 1;
+    due_ = last_start_ + (speed_ ? delta / speed_ : 0);
+    tx_started_ = false;
+    return true;
+}
+
+// Next byte of the capture, -1 at its end
+int EspReplayStream::captureByte()
+{
+    return capture_->read();
+}
@@ -0,0 +1,100 @@
+/*------------------------------------------------------------------------
+Session capture and replay for SimpleESP8266
+
+EspCaptureStream sits between the library and the module's serial port
+and records every byte in both directions, with timestamps, to any Print
+(an SD card file, a spare serial port...):
+
+    EspCaptureStream capture(&Serial1, &log_file);
+    SimpleESP8266 esp(&capture, &Serial);
+
+EspReplayStream plays a capture back in place of the module, so a field
+session becomes a repeatable test.  It answers with the recorded module
+output, keeping the recorded delay between the library's commands and
+the module's replies (optionally sped up), and checks that the library
+sends what it sent before.  The capture is read from any Stream holding
+all of it (a file, or a memory buffer), and only Stream and millis() are
+needed, so replays run on the board or under a host-side Arduino
+emulation.
+
+Capture format: "ESPC", a version byte (1), then records of
+    <tag> <delta> <data>
+where tag bit 7 is set for bytes sent to the module, bits 0-6 hold the
+data length - 1, and delta is the time (in milliseconds) since the
+previous record started, as a base-128 varint (low bits first, bit 7 set
+on all but the last byte).
+
+MIT license, all text above must be included in any redistribution.
+------------------------------------------------------------------------*/
+
+#ifndef EspCapture_H
+#define EspCapture_H
+#include <Arduino.h>
+
+#define ESP_CAPTURE_RUN       32       //Most bytes per record (at most 128)
+#define ESP_CAPTURE_TICK      2        //Time (in milliseconds) after which a new record is started, to keep the timing
+#define ESP_CAPTURE_VERSION   1
+
+class EspCaptureStream : public Stream
+{
+public:
+    EspCaptureStream(Stream *stream, Print *sink);
+    virtual int    available();
+    virtual int    read();
+    virtual int    peek();
+    virtual size_t write(uint8_t c);
+    virtual size_t write(const uint8_t *buffer, size_t size);
+    virtual int    availableForWrite();
+    virtual void   flush();
+    using Print::write;
+private:
+    Stream   *stream_;
+    Print    *sink_;
+    boolean   started_;      // Header written
+    uint8_t   run_[ESP_CAPTURE_RUN];
+    uint8_t   run_len_;
+    boolean   run_tx_;
+    uint32_t  run_start_;    // millis() of the first byte of the run
+    uint32_t  last_start_;   // ...and of the last record written
+    void      record(boolean tx, uint8_t c);
+    void      endRun();
+};
+
+// Results of a replay so far
+struct EspReplayStats
+{
+    uint32_t rx_bytes;       //Recorded module output handed to the library
+    uint32_t tx_bytes;       //Bytes the library sent
+    uint32_t tx_mismatches;  //Bytes sent that differ from the capture (or go past its end)
+    uint32_t max_lag_ms;     //Worst delay of a command against the recorded timing
+    uint32_t total_lag_ms;   //Sum of those delays
+    boolean  done;           //The whole capture has been played
+    boolean  bad_format;     //The capture isn't one
+};
+
+class EspReplayStream : public Stream
+{
+public:
+    EspReplayStream(Stream *capture, uint8_t speed = 1);
+    virtual int    available();
+    virtual int    read();
+    virtual int    peek();
+    virtual size_t write(uint8_t c);
+    using Print::write;
+    const EspReplayStats *stats();
+private:
+    Stream   *capture_;
+    uint8_t   speed_;        // Timing divisor, 0 to play as fast as possible
+    boolean   started_;
+    boolean   tx_;           // Direction of the current record
+    uint8_t   left_;         // Data bytes of the current record still to play
+    uint32_t  due_;          // millis() at which the current record starts
+    uint32_t  last_start_;   // millis() at which the previous record really started
+    boolean   tx_started_;   // The library has begun the current (TX) record
+    EspReplayStats stats_;
+    boolean   ready();
+    boolean   nextRecord();
+    int       captureByte();
+};
+
+#endif // EspCapture_H
@@ -0,0 +1,137 @@
+/*------------------------------------------------------------------------
+RAM footprint of the ESP8266 libraries
+
+MIT license, all text above must be included in any redistribution.
+------------------------------------------------------------------------*/
+
+#include "EspFootprint.h"
+#include "SimpleEsp8266Tasks.h"
+#include "EspMqtt.h"
+#include "EspWebSocket.h"
+#include "EspLz.h"
+#include "EspCapture.h"
+#include "EspMulti.h"
+
+#define FOOTPRINT_CORE        sizeof(SimpleESP8266)
+#define FOOTPRINT_TASKS       sizeof(EspSetupServerTask)
+#define FOOTPRINT_MQTT        sizeof(EspMqttClient)
+#define FOOTPRINT_WEBSOCKET   sizeof(EspWebSocketServer)
+#define FOOTPRINT_LZ          (sizeof(EspLzEncoder) + sizeof(EspLzDecoder))
+#define FOOTPRINT_CAPTURE     sizeof(EspCaptureStream)
+#define FOOTPRINT_MULTI       (sizeof(EspMulti) + sizeof(EspMultiModule))
+
+//Stop the build if an object has outgrown its budget
+#define CHECK_BUDGET(size, budget) \
+    static_assert((budget) == 0 || (size) <= (budget), #size " is over " #budget)
+CHECK_BUDGET(FOOTPRINT_CORE, ESP_BUDGET_CORE);
+CHECK_BUDGET(FOOTPRINT_TASKS, ESP_BUDGET_TASKS);
+CHECK_BUDGET(FOOTPRINT_MQTT, ESP_BUDGET_MQTT);
+CHECK_BUDGET(FOOTPRINT_WEBSOCKET, ESP_BUDGET_WEBSOCKET);
+CHECK_BUDGET(FOOTPRINT_LZ, ESP_BUDGET_LZ);
+CHECK_BUDGET(FOOTPRINT_CAPTURE, ESP_BUDGET_CAPTURE);
+CHECK_BUDGET(FOOTPRINT_MULTI, ESP_BUDGET_MULTI);
+
+#if defined(__AVR__)
+extern char  __heap_start;
+extern char *__brkval;
+
+// Lowest address the stack may grow down to
+static char *heapEnd()
+{
+    return __brkval ? __brkval : &__heap_start;
+}
+#endif
+
+// Fill the free RAM between the heap and the stack with ESP_STACK_FILL, so
+// espStackUsed() can later tell how far down the stack has reached
+void espStackPaint()
+{
+#if defined(__AVR__)
+    char *p = heapEnd();
+    char *end = (char *)SP - ESP_STACK_MARGIN;
+    while (p < end)
+    {
+        *p++ = ESP_STACK_FILL;
+    }
+#endif
+}
+
+// Deepest the stack has been since espStackPaint(), or 0 where that isn't
+// measured.  The scan starts above the heap as it is now, so heap that grew
+// since painting isn't counted; but heap that grew and was freed again
+// (lowering __brkval) left its bytes overwritten and counts as stack.  So
+// paint after setup()'s lasting allocations, and prefer static buffers.
+uint16_t espStackUsed()
+{
+#if defined(__AVR__)
+    const char *p = heapEnd();
+    while (p <= (const char *)RAMEND && *p == (char)ESP_STACK_FILL)
+    {
+        p++;
+    }
+    return (const char *)RAMEND - p + 1;
+#else
+    return 0;
+#endif
+}
+
+void espFootprint(EspFootprint *footprint)
+{
+    footprint->core = FOOTPRINT_CORE;
+    footprint->tasks = FOOTPRINT_TASKS;
+    footprint->mqtt = FOOTPRINT_MQTT;
+    footprint->websocket = FOOTPRINT_WEBSOCKET;
+    footprint->lz = FOOTPRINT_LZ;
+    footprint->capture = FOOTPRINT_CAPTURE;
+    footprint->multi = FOOTPRINT_MULTI;
+    footprint->stack = espStackUsed();
+#if defined(__AVR__)
+    footprint->free_ram = (char *)SP - heapEnd();
+#else
+    footprint->free_ram = 0;
+#endif
+}
+
+static boolean checkLine(Print *out, EspStr *name, uint16_t size, uint16_t budget)
+{
+    boolean ok = (budget == 0 || size <= budget);
+    if (out)
+    {
+        out->print(name);
+        out->print(size);
+        if (budget)
+        {
+            out->print(F(" / "));
+            out->print(budget);
+        }
+        if (!ok)
+        {
+            out->print(F(" OVER BUDGET"));
+        }
+        out->println();
+    }
+    return ok;
+}
+
+// Print each feature's RAM use, with its budget if it has one, to out (if
+// not NULL).  Returns false if anything is over budget.
+boolean espCheckFootprint(Print *out)
+{
+    EspFootprint footprint;
+    boolean      ok = true;
+    espFootprint(&footprint);
+    ok &= checkLine(out, F("core      "), footprint.core, ESP_BUDGET_CORE);
+    ok &= checkLine(out, F("tasks     "), footprint.tasks, ESP_BUDGET_TASKS);
+    ok &= checkLine(out, F("mqtt      "), footprint.mqtt, ESP_BUDGET_MQTT);
+    ok &= checkLine(out, F("websocket "), footprint.websocket, ESP_BUDGET_WEBSOCKET);
+    ok &= checkLine(out, F("lz        "), footprint.lz, ESP_BUDGET_LZ);
+    ok &= checkLine(out, F("capture   "), footprint.capture, ESP_BUDGET_CAPTURE);
+    ok &= checkLine(out, F("multi     "), footprint.multi, ESP_BUDGET_MULTI);
+    ok &= checkLine(out, F("stack     "), footprint.stack, ESP_BUDGET_STACK);
+    if (out)
+    {
+        out->print(F("free ram  "));
+        out->println(footprint.free_ram);
+    }
+    return ok;
+}
@@ -0,0 +1,76 @@
+/*------------------------------------------------------------------------
+RAM footprint of the ESP8266 libraries
+
+Each optional feature costs RAM for its objects, and every blocking call
+costs stack.  The budgets below are checked when the library compiles, so
+a change that makes an object bigger than its budget stops the build.
+Set one to the most bytes you can spare (0 means no limit) with a build
+flag, e.g. -DESP_BUDGET_CORE=300 (a #define in the sketch doesn't reach
+the library's own files).
+
+Stack is measured while running: call espStackPaint() first thing in
+setup(), exercise the sketch, then espCheckFootprint(&Serial) prints the
+object sizes and the deepest the stack has been, and returns false if
+it went past ESP_BUDGET_STACK.  Stack is only measured on AVR.
+
+extras/footprint/check_footprint.sh builds every configuration (each
+feature, client and server, with and without DEBUG_ENABLED) and checks
+the objects' sizes from avr-nm and the totals from avr-size against the
+budgets, and runs each in simavr to check its stack.
+
+MIT license, all text above must be included in any redistribution.
+------------------------------------------------------------------------*/
+
+#ifndef EspFootprint_H
+#define EspFootprint_H
+#include <Arduino.h>
+
+//RAM budgets (in bytes), 0 for no limit
+#ifndef ESP_BUDGET_CORE
+#define ESP_BUDGET_CORE       0        //A SimpleESP8266
+#endif
+#ifndef ESP_BUDGET_TASKS
+#define ESP_BUDGET_TASKS      0        //An EspSetupServerTask, the largest task
+#endif
+#ifndef ESP_BUDGET_MQTT
+#define ESP_BUDGET_MQTT       0        //An EspMqttClient
+#endif
+#ifndef ESP_BUDGET_WEBSOCKET
+#define ESP_BUDGET_WEBSOCKET  0        //An EspWebSocketServer
+#endif
+#ifndef ESP_BUDGET_LZ
+#define ESP_BUDGET_LZ         0        //An EspLzEncoder and an EspLzDecoder
+#endif
+#ifndef ESP_BUDGET_CAPTURE
+#define ESP_BUDGET_CAPTURE    0        //An EspCaptureStream
+#endif
+#ifndef ESP_BUDGET_MULTI
+#define ESP_BUDGET_MULTI      0        //An EspMulti and one EspMultiModule
+#endif
+#ifndef ESP_BUDGET_STACK
+#define ESP_BUDGET_STACK      0        //Deepest stack since espStackPaint()
+#endif
+
+#define ESP_STACK_FILL        0xC5     //Pattern espStackPaint() fills free RAM with
+#define ESP_STACK_MARGIN      32       //Bytes below the current stack pointer left unpainted
+
+// Object sizes (in bytes) and stack use
+struct EspFootprint
+{
+    uint16_t core;
+    uint16_t tasks;
+    uint16_t mqtt;
+    uint16_t websocket;
+    uint16_t lz;
+    uint16_t capture;
+    uint16_t multi;
+    uint16_t stack;          //Deepest stack since espStackPaint(), 0 if not measured
+    uint16_t free_ram;       //Free RAM between the heap and the stack now, 0 if not known
+};
+
+void     espStackPaint();
+uint16_t espStackUsed();
+void     espFootprint(EspFootprint *footprint);
+boolean  espCheckFootprint(Print *out = NULL);
+
+#endif // EspFootprint_H
@@ -0,0 +1,58 @@
+/*------------------------------------------------------------------------
+Idle strategies for the ESP8266 libraries' blocking waits
+
+While a blocking call waits for the module it polls the serial port.
+Between polls it calls espIdle(), which depending on the strategy does
+nothing, lets other code run, or puts the CPU to sleep until the next
+interrupt (a received byte, or the millis() timer tick, so timeouts are
+still noticed within a millisecond).
+
+MIT license, all text above must be included in any redistribution.
+------------------------------------------------------------------------*/
+
+#ifndef EspIdle_H
+#define EspIdle_H
+#include <Arduino.h>
+#if defined(__AVR__)
+#include <avr/sleep.h>
+#endif
+
+#define ESP_IDLE_SPIN         0        //Poll continuously (lowest latency, full power)
+#define ESP_IDLE_YIELD        1        //Call yield() between polls
+#define ESP_IDLE_CALLBACK     2        //Call a user function between polls
+#define ESP_IDLE_SLEEP        3        //Sleep the CPU until the next interrupt
+
+typedef void (*EspIdleCallback)(void *context);
+
+static inline void espIdle(uint8_t strategy, EspIdleCallback callback, void *context)
+{
+    switch (strategy)
+    {
+    case ESP_IDLE_YIELD:
+        yield();
+        break;
+    case ESP_IDLE_CALLBACK:
+        if (callback)
+        {
+            callback(context);
+        }
+        break;
+    case ESP_IDLE_SLEEP:
+#if defined(__AVR__)
+        //Idle mode keeps the UART and timers running, so any RX byte wakes us
+        set_sleep_mode(SLEEP_MODE_IDLE);
+        sleep_enable();
+        sleep_cpu();
+        sleep_disable();
+#elif defined(__arm__)
+        __asm__ volatile ("wfi");
+#else
+        yield();
+#endif
+        break;
+    default:
+        break;
+    }
+}
+
+#endif // EspIdle_H
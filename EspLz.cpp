@@ -0,0 +1,290 @@
+/*------------------------------------------------------------------------
+Streaming LZ compression for SimpleESP8266 payloads
+
+MIT license, all text above must be included in any redistribution.
+------------------------------------------------------------------------*/
+
+#include "EspLz.h"
+
+//Decoder states
+#define LZ_TOKEN              0
+#define LZ_LITERAL            1
+#define LZ_OFFSET             2
+
+// Hash of the ESP_LZ_MIN_MATCH bytes a match has to start with
+static uint8_t lzHash(uint8_t a, uint8_t b, uint8_t c)
+{
+    uint8_t h = a;
+    h = (h << 3) ^ (h >> 5) ^ b;
+    h = (h << 3) ^ (h >> 5) ^ c;
+    return h & (ESP_LZ_HASH_SIZE - 1);
+}
+
+EspLzEncoder::EspLzEncoder()
+{
+    reset();
+}
+
+// Forget the history, e.g. when the connection is reopened
+void EspLzEncoder::reset()
+{
+    head_ = 0;
+    filled_ = 0;
+    last_distance_ = 0;
+    memset(hash_, 0, sizeof(hash_));
+}
+
+// Compress as much of data as fits in out.  *consumed is set to the number
+// of input bytes used.  Returns the number of bytes written to out, which
+// always ends on a whole token.
+uint16_t EspLzEncoder::encode(const uint8_t *data, uint16_t len, uint16_t *consumed, uint8_t *out, uint16_t out_size)
+{
+    uint16_t pos = 0;
+    uint16_t written = 0;
+    int16_t  run = -1;   // Index in out of the current literal run's token, if any
+    while (pos < len)
+    {
+        uint16_t distance;
+        uint8_t  match = findMatch(data + pos, len - pos, &distance);
+        if (match >= ESP_LZ_MIN_MATCH)
+        {
+            if (written + 2 > out_size)
+            {
+                break;
+            }
+            out[written++] = 0x80 | (match - ESP_LZ_MIN_MATCH);
+            out[written++] = distance - 1;
+            last_distance_ = distance;
+            run = -1;
+            for (uint8_t i = 0; i < match; ++i)
+            {
+                push(data[pos++]);
+            }
+        } else
+        {
+            if (run >= 0 && out[run] < ESP_LZ_MAX_LITERALS - 1)
+            {
+                if (written + 1 > out_size)
+                {
+                    break;
+                }
+                out[run]++;
+            } else
+            {
+                if (written + 2 > out_size)
+                {
+                    break;
+                }
+                run = written;
+                out[written++] = 0;
+            }
+            out[written++] = data[pos];
+            push(data[pos++]);
+        }
+    }
+    *consumed = pos;
+    return written;
+}
+
+// Compress data and send it on link.  Each CIPSEND carries as much as the
+// link's current chunk size allows (see linkStats()), up to the size of
+// buffer, the RAM to compress into; without one, ESP_LZ_SEND_CHUNK bytes of
+// stack are used.  Returns false if a send failed, after which the far end
+// is out of step and the connection should be restarted, or if buffer is
+// too small to hold a token (nothing is sent then).
+boolean EspLzEncoder::send(SimpleESP8266 *esp, const uint8_t *data, uint16_t len, uint8_t link,
+                           uint8_t *buffer, uint16_t buffer_size)
+{
+    uint8_t stack_buffer[ESP_LZ_SEND_CHUNK];
+    if (buffer == NULL)
+    {
+        buffer = stack_buffer;
+        buffer_size = sizeof(stack_buffer);
+    }
+    if (buffer_size < ESP_LZ_MIN_OUT)
+    {
+        return false;
+    }
+    while (len > 0)
+    {
+        uint16_t used;
+        uint16_t size = esp->linkStats(link)->chunk_size;
+        if (size > buffer_size)
+        {
+            size = buffer_size;
+        }
+        uint16_t n = encode(data, len, &used, buffer, size);
+        if (used == 0 || !esp->tcpSend(buffer, n, link))
+        {
+            return false;
+        }
+        data += used;
+        len -= used;
+    }
+    return true;
+}
+
+void EspLzEncoder::push(uint8_t c)
+{
+    window_[head_++] = c;   //head_ wraps at 256 by itself
+    if (filled_ < ESP_LZ_WINDOW)
+    {
+        filled_++;
+    }
+    //Remember where the sequence ending with c starts
+    if (filled_ >= ESP_LZ_MIN_MATCH)
+    {
+        uint8_t  start = head_ - ESP_LZ_MIN_MATCH;
+        uint8_t *ways = hash_[lzHash(window_[start], window_[(uint8_t)(start + 1)], c)];
+        memmove(ways + 1, ways, ESP_LZ_HASH_WAYS - 1);
+        ways[0] = start;
+    }
+}
+
+// Longest match for the start of data in the history (or overlapping into
+// data itself, as the decoder copies a byte at a time).  Returns its length
+// and sets *distance.  Only a few places are tried: the latest
+// ESP_LZ_HASH_WAYS that started with bytes of the same hash, distances 1
+// and 2 (runs, which straddle the end of the history so aren't in the table
+// yet) and the last match's distance (the same field of the previous
+// frame).  So a longer match further back may be missed.
+uint8_t EspLzEncoder::findMatch(const uint8_t *data, uint16_t len, uint16_t *distance)
+{
+    uint8_t  best = 0;
+    uint8_t  limit = (len < ESP_LZ_MAX_MATCH) ? len : ESP_LZ_MAX_MATCH;
+    uint16_t candidates[3 + ESP_LZ_HASH_WAYS];
+    uint8_t *ways;
+    if (limit < ESP_LZ_MIN_MATCH)
+    {
+        return 0;
+    }
+    candidates[0] = 1;
+    candidates[1] = 2;
+    candidates[2] = last_distance_;
+    ways = hash_[lzHash(data[0], data[1], data[2])];
+    for (uint8_t w = 0; w < ESP_LZ_HASH_WAYS; ++w)
+    {
+        //A distance of 0 is a whole window back
+        candidates[3 + w] = (uint8_t)(head_ - ways[w]);
+        if (candidates[3 + w] == 0)
+        {
+            candidates[3 + w] = ESP_LZ_WINDOW;
+        }
+    }
+    for (uint8_t i = 0; i < sizeof(candidates) / sizeof(candidates[0]); ++i)
+    {
+        uint16_t d = candidates[i];
+        if (d == 0 || d > filled_)
+        {
+            continue;
+        }
+        uint8_t n = matchLength(data, limit, d);
+        if (n > best)
+        {
+            best = n;
+            *distance = d;
+            if (best == limit)
+            {
+                break;
+            }
+        }
+    }
+    return best;
+}
+
+// How many bytes from the start of data (up to limit) repeat what came
+// distance bytes before
+uint8_t EspLzEncoder::matchLength(const uint8_t *data, uint8_t limit, uint16_t distance)
+{
+    uint8_t n = 0;
+    while (n < limit)
+    {
+        uint8_t c = (n < distance) ? window_[(uint8_t)(head_ - distance + n)] : data[n - distance];
+        if (c != data[n])
+        {
+            break;
+        }
+        n++;
+    }
+    return n;
+}
+
+EspLzDecoder::EspLzDecoder()
+{
+    reset();
+}
+
+void EspLzDecoder::reset()
+{
+    head_ = 0;
+    state_ = LZ_TOKEN;
+    count_ = 0;
+    copy_ = 0;
+    distance_ = 0;
+}
+
+// Decompress received bytes into out.  *consumed is set to the number of
+// input bytes used, which is less than len if out filled up.  Call again
+// with the rest (or with len = 0 while pending()) until everything is out.
+// Tokens may be split across calls.  Returns the number of bytes written.
+uint16_t EspLzDecoder::decode(const uint8_t *data, uint16_t len, uint16_t *consumed, uint8_t *out, uint16_t out_size)
+{
+    uint16_t pos = 0;
+    uint16_t written = 0;
+    while (written < out_size)
+    {
+        if (copy_ > 0)
+        {
+            uint8_t c = window_[(uint8_t)(head_ - distance_)];
+            out[written++] = c;
+            push(c);
+            copy_--;
+            continue;
+        }
+        if (pos >= len)
+        {
+            break;
+        }
+        uint8_t c = data[pos++];
+        switch (state_)
+        {
+        case LZ_TOKEN:
+            if (c & 0x80)
+            {
+                count_ = (c & 0x7F) + ESP_LZ_MIN_MATCH;
+                state_ = LZ_OFFSET;
+            } else
+            {
+                count_ = c + 1;
+                state_ = LZ_LITERAL;
+            }
+            break;
+        case LZ_OFFSET:
+            distance_ = c + 1;
+            copy_ = count_;
+            state_ = LZ_TOKEN;
+            break;
+        default:
+            out[written++] = c;
+            push(c);
+            if (--count_ == 0)
+            {
+                state_ = LZ_TOKEN;
+            }
+            break;
+        }
+    }
+    *consumed = pos;
+    return written;
+}
+
+// true if decode() has output left over from a copy that didn't fit
+boolean EspLzDecoder::pending()
+{
+    return copy_ > 0;
+}
+
+void EspLzDecoder::push(uint8_t c)
+{
+    window_[head_++] = c;
+}
@@ -0,0 +1,70 @@
+/*------------------------------------------------------------------------
+Streaming LZ compression for SimpleESP8266 payloads
+
+A small LZ77 coder with a 256 byte window.  Both ends keep the last 256
+bytes of the connection's uncompressed data, so matches reach back into
+earlier messages: a stream of similar JSON/CSV frames shrinks to a few
+bytes per field that changed.  The format is byte aligned and every send
+ends on a token boundary, so each CIPSEND can be decoded as it arrives:
+
+    0nnnnnnn <n+1 bytes>    literal run of 1 to 128 bytes
+    1nnnnnnn <d>            copy n+3 (3 to 130) bytes from d+1 bytes back
+
+Compression is chosen per connection: use an EspLzEncoder for each link
+whose far end decodes, and an EspLzDecoder for each link whose far end
+encodes.  Both ends must start (or reset()) together, e.g. on connect,
+and after a failed send the connection has to be restarted.
+
+MIT license, all text above must be included in any redistribution.
+------------------------------------------------------------------------*/
+
+#ifndef EspLz_H
+#define EspLz_H
+#include "SimpleEsp8266.h"
+
+#define ESP_LZ_WINDOW         256      //History kept by each end (offsets are one byte, so at most 256)
+#define ESP_LZ_MIN_MATCH      3        //Shortest copy worth a token
+#define ESP_LZ_MAX_MATCH      (127 + ESP_LZ_MIN_MATCH)
+#define ESP_LZ_MAX_LITERALS   128
+#define ESP_LZ_MIN_OUT        2        //Smallest output that holds a token: a one byte literal run, or a copy
+#define ESP_LZ_SEND_CHUNK     128      //Stack buffer EspLzEncoder::send() compresses into when not given one
+#define ESP_LZ_HASH_SIZE      16       //Buckets in the encoder's table of where 3 byte sequences were seen (a power of 2)
+#define ESP_LZ_HASH_WAYS      8        //Latest places remembered per bucket, each one tried for a match
+
+class EspLzEncoder
+{
+public:
+    EspLzEncoder();
+    void     reset();
+    uint16_t encode(const uint8_t *data, uint16_t len, uint16_t *consumed, uint8_t *out, uint16_t out_size);
+    boolean  send(SimpleESP8266 *esp, const uint8_t *data, uint16_t len, uint8_t link = 0,
+                  uint8_t *buffer = NULL, uint16_t buffer_size = 0);
+private:
+    uint8_t  window_[ESP_LZ_WINDOW];
+    uint8_t  hash_[ESP_LZ_HASH_SIZE][ESP_LZ_HASH_WAYS]; // Index in window_ of the latest sequences with each hash, newest first
+    uint8_t  head_;     // Where the next byte goes in window_
+    uint16_t filled_;   // Bytes of window_ in use
+    uint16_t last_distance_; // Distance of the last match
+    void     push(uint8_t c);
+    uint8_t  findMatch(const uint8_t *data, uint16_t len, uint16_t *distance);
+    uint8_t  matchLength(const uint8_t *data, uint8_t limit, uint16_t distance);
+};
+
+class EspLzDecoder
+{
+public:
+    EspLzDecoder();
+    void     reset();
+    uint16_t decode(const uint8_t *data, uint16_t len, uint16_t *consumed, uint8_t *out, uint16_t out_size);
+    boolean  pending();
+private:
+    uint8_t  window_[ESP_LZ_WINDOW];
+    uint8_t  head_;
+    uint8_t  state_;
+    uint8_t  count_;    // Literals left in the run, or length of the copy awaiting its offset
+    uint8_t  copy_;     // Bytes of the current copy still to output
+    uint16_t distance_;
+    void     push(uint8_t c);
+};
+
+#endif // EspLz_H
@@ -0,0 +1,441 @@
+/*------------------------------------------------------------------------
+Minimal MQTT 3.1.1 client for SimpleESP8266
+
+MIT license, all text above must be included in any redistribution.
+------------------------------------------------------------------------*/
+
+#include "EspMqtt.h"
+
+//Control packet types (first byte of the fixed header, upper nibble)
+#define MQTT_CONNECT          1
+#define MQTT_CONNACK          2
+#define MQTT_PUBLISH          3
+#define MQTT_SUBSCRIBE        8
+#define MQTT_SUBACK           9
+#define MQTT_PINGREQ          12
+#define MQTT_PINGRESP         13
+#define MQTT_DISCONNECT       14
+
+//Decoder states
+#define MQTT_RX_HEADER        0
+#define MQTT_RX_LENGTH        1
+#define MQTT_RX_TOPIC_LEN     2
+#define MQTT_RX_TOPIC         3
+#define MQTT_RX_PACKET_ID     4
+#define MQTT_RX_PAYLOAD       5
+#define MQTT_RX_BODY          6
+
+EspMqttClient::EspMqttClient(SimpleESP8266 *esp) :
+    esp_(esp), connected_(false), keepalive_ms_(ESP_MQTT_KEEPALIVE * 1000UL),
+    last_tx_(0), ping_sent_(0), ping_outstanding_(false), packet_id_(0),
+    callback_(NULL), context_(NULL), tx_len_(0), rx_state_(MQTT_RX_HEADER),
+    last_ack_(0)
+{
+}
+
+// Open a TCP connection to the broker and log in.  The session is clean
+// (subscriptions don't survive a reconnect).  user and pass may be NULL.
+// Returns true once the broker has accepted the connection.
+boolean EspMqttClient::connect(EspStr *host, int port, EspStr *client_id,
+                               EspStr *user, EspStr *pass, uint16_t keepalive)
+{
+    uint32_t remaining;
+    uint8_t  flags = 0x02;   //Clean session
+    static const uint8_t protocol[] PROGMEM = { 0, 4, 'M', 'Q', 'T', 'T', 4 };
+
+    connected_ = false;
+    if (!esp_->connectTCP(host, port))
+    {
+        return false;
+    }
+    tx_len_ = 0;
+    rx_state_ = MQTT_RX_HEADER;
+    ping_outstanding_ = false;
+    keepalive_ms_ = keepalive * 1000UL;
+
+    remaining = sizeof(protocol) + 1 + 2 + 2 + strlen_P((const char *)client_id);
+    if (user)
+    {
+        flags |= 0x80;
+        remaining += 2 + strlen_P((const char *)user);
+    }
+    if (pass)
+    {
+        flags |= 0x40;
+        remaining += 2 + strlen_P((const char *)pass);
+    }
+    putHeader(MQTT_CONNECT << 4, remaining);
+    putP((EspStr *)protocol, sizeof(protocol));
+    putByte(flags);
+    putByte(keepalive >> 8);
+    putByte(keepalive & 0xFF);
+    putStringP(client_id);
+    if (user)
+    {
+        putStringP(user);
+    }
+    if (pass)
+    {
+        putStringP(pass);
+    }
+    connected_ = true;   //So flush() sends
+    if (!flush() || !waitFor(MQTT_CONNACK) || body_[1] != 0)
+    {
+        //body_[1] is the CONNACK return code: 0 = accepted
+        connected_ = false;
+        esp_->closeTCP();
+        return false;
+    }
+    return true;
+}
+
+void EspMqttClient::disconnect()
+{
+    if (connected_)
+    {
+        putHeader(MQTT_DISCONNECT << 4, 0);
+        flush();
+        esp_->closeTCP();
+    }
+    connected_ = false;
+    tx_len_ = 0;
+}
+
+// false once the connection has failed (a send failed, the connection
+// closed or the broker stopped answering pings)
+boolean EspMqttClient::connected()
+{
+    return connected_;
+}
+
+// Queue a QoS 0 message.  It's sent with whatever else is queued when the
+// buffer fills or on the next loop()/flush().  Returns false if not
+// connected or a send failed.  (Lengths are added as uint32_t: int is 16
+// bits on AVR, and a payload near 64KB would wrap.)
+boolean EspMqttClient::publish(const char *topic, const uint8_t *payload, uint16_t len)
+{
+    uint16_t topic_len = strlen(topic);
+    if (!connected_)
+    {
+        return false;
+    }
+    putHeader(MQTT_PUBLISH << 4, 2 + (uint32_t)topic_len + len);
+    putByte(topic_len >> 8);
+    putByte(topic_len & 0xFF);
+    put((const uint8_t *)topic, topic_len);
+    put(payload, len);
+    return connected_;
+}
+
+boolean EspMqttClient::publish(EspStr *topic, const uint8_t *payload, uint16_t len)
+{
+    uint16_t topic_len = strlen_P((const char *)topic);
+    if (!connected_)
+    {
+        return false;
+    }
+    putHeader(MQTT_PUBLISH << 4, 2 + (uint32_t)topic_len + len);
+    putStringP(topic);
+    put(payload, len);
+    return connected_;
+}
+
+// Subscribe to a topic filter at QoS 0.  Messages go to the callback (see
+// setCallback()).  Returns true once the broker has granted it.
+boolean EspMqttClient::subscribe(EspStr *topic)
+{
+    if (!connected_)
+    {
+        return false;
+    }
+    if (++packet_id_ == 0)
+    {
+        packet_id_ = 1;
+    }
+    putHeader((MQTT_SUBSCRIBE << 4) | 0x02, 2 + 2 + (uint32_t)strlen_P((const char *)topic) + 1);
+    putByte(packet_id_ >> 8);
+    putByte(packet_id_ & 0xFF);
+    putStringP(topic);
+    putByte(0);   //Requested QoS
+    //body_[2] is the granted QoS, 0x80 if refused
+    return flush() && waitFor(MQTT_SUBACK) && body_[2] != 0x80;
+}
+
+// Send everything queued in one CIPSEND.  Returns false if the send failed.
+boolean EspMqttClient::flush()
+{
+    if (!connected_)
+    {
+        tx_len_ = 0;
+        return false;
+    }
+    if (tx_len_ == 0)
+    {
+        return true;
+    }
+    if (!esp_->tcpSend(tx_, tx_len_))
+    {
+        connected_ = false;
+    }
+    tx_len_ = 0;
+    last_tx_ = millis();
+    return connected_;
+}
+
+// Call often.  Sends queued messages, passes received ones to the callback,
+// and keeps the connection alive.  Returns connected().
+boolean EspMqttClient::loop()
+{
+    if (!connected_)
+    {
+        return false;
+    }
+    if (!flush())
+    {
+        return false;
+    }
+    while (esp_->recvWaiting())
+    {
+        esp_->setDeadline(millis() + ESP_MQTT_POLL_TIMEOUT);
+        if (!receive())
+        {
+            break;
+        }
+    }
+    if (!(esp_->openLinks() & 1))
+    {
+        //The module reported the connection CLOSED, e.g. the broker
+        //dropped us, so don't wait for a ping to time out
+        connected_ = false;
+        return false;
+    }
+    if (ping_outstanding_)
+    {
+        if ((millis() - ping_sent_) > keepalive_ms_)
+        {
+            connected_ = false;   //Broker has gone
+        }
+    } else if (keepalive_ms_ && (millis() - last_tx_) >= keepalive_ms_ / 2)
+    {
+        putHeader(MQTT_PINGREQ << 4, 0);
+        ping_outstanding_ = true;
+        ping_sent_ = millis();
+        flush();
+    }
+    return connected_;
+}
+
+void EspMqttClient::setCallback(EspMqttCallback callback, void *context)
+{
+    callback_ = callback;
+    context_ = context;
+}
+
+// Append to the outgoing buffer, sending it whenever it fills
+void EspMqttClient::put(const uint8_t *data, uint16_t len)
+{
+    while (len > 0)
+    {
+        uint16_t n = sizeof(tx_) - tx_len_;
+        if (n > len)
+        {
+            n = len;
+        }
+        memcpy(tx_ + tx_len_, data, n);
+        tx_len_ += n;
+        data += n;
+        len -= n;
+        if (tx_len_ == sizeof(tx_))
+        {
+            flush();
+        }
+    }
+}
+
+void EspMqttClient::putByte(uint8_t c)
+{
+    put(&c, 1);
+}
+
+void EspMqttClient::putP(EspStr *str, uint16_t len)
+{
+    const char *p = (const char *)str;
+    while (len > 0)
+    {
+        uint16_t n = sizeof(tx_) - tx_len_;
+        if (n > len)
+        {
+            n = len;
+        }
+        memcpy_P(tx_ + tx_len_, p, n);
+        tx_len_ += n;
+        p += n;
+        len -= n;
+        if (tx_len_ == sizeof(tx_))
+        {
+            flush();
+        }
+    }
+}
+
+// Fixed header: type/flags byte and the remaining length, 7 bits per byte
+void EspMqttClient::putHeader(uint8_t type, uint32_t remaining)
+{
+    putByte(type);
+    do
+    {
+        uint8_t c = remaining & 0x7F;
+        remaining >>= 7;
+        putByte(remaining ? (c | 0x80) : c);
+    } while (remaining);
+}
+
+// Length-prefixed string from flash
+void EspMqttClient::putStringP(EspStr *str)
+{
+    uint16_t len = strlen_P((const char *)str);
+    putByte(len >> 8);
+    putByte(len & 0xFF);
+    putP(str, len);
+}
+
+// Read and decode input until a packet of the given type has arrived or
+// ESP_MQTT_ACK_TIMEOUT passes
+boolean EspMqttClient::waitFor(uint8_t type)
+{
+    uint32_t t0 = millis();
+    last_ack_ = 0;
+    while (last_ack_ != type)
+    {
+        if ((millis() - t0) > ESP_MQTT_ACK_TIMEOUT)
+        {
+            return false;
+        }
+        esp_->setDeadline(t0 + ESP_MQTT_ACK_TIMEOUT);
+        if (!receive())
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Read one piece of +IPD data and run it through the decoder
+boolean EspMqttClient::receive()
+{
+    char    chunk[ESP_MQTT_RX_CHUNK];
+    int32_t len = esp_->tcpRecv(chunk, sizeof(chunk));
+    if (len <= 0)
+    {
+        return false;
+    }
+    for (int32_t i = 0; i < len; ++i)
+    {
+        decode(chunk[i]);
+    }
+    return true;
+}
+
+void EspMqttClient::decode(uint8_t c)
+{
+    switch (rx_state_)
+    {
+    case MQTT_RX_HEADER:
+        rx_header_ = c;
+        rx_remaining_ = 0;
+        rx_shift_ = 0;
+        rx_state_ = MQTT_RX_LENGTH;
+        return;
+    case MQTT_RX_LENGTH:
+        rx_remaining_ |= (uint32_t)(c & 0x7F) << rx_shift_;
+        rx_shift_ += 7;
+        if (!(c & 0x80))
+        {
+            startBody();
+        }
+        return;
+    case MQTT_RX_TOPIC_LEN:
+        topic_len_ = (topic_len_ << 8) | c;
+        if (++rx_count_ == 2)
+        {
+            rx_count_ = 0;
+            rx_state_ = MQTT_RX_TOPIC;
+        }
+        break;
+    case MQTT_RX_TOPIC:
+        if (rx_count_ < ESP_MQTT_TOPIC_MAX)
+        {
+            topic_[rx_count_] = c;
+        }
+        rx_count_++;
+        break;
+    case MQTT_RX_PACKET_ID:
+        rx_count_++;
+        break;
+    case MQTT_RX_PAYLOAD:
+        if (payload_len_ < ESP_MQTT_PAYLOAD_MAX)
+        {
+            payload_[payload_len_++] = c;
+        }
+        break;
+    default:
+        if (rx_count_ < sizeof(body_))
+        {
+            body_[rx_count_] = c;
+        }
+        rx_count_++;
+        break;
+    }
+    //The topic and packet ID (only sent for QoS 1 and 2) end by length
+    if (rx_state_ == MQTT_RX_TOPIC && rx_count_ == topic_len_)
+    {
+        rx_count_ = 0;
+        rx_state_ = (rx_header_ & 0x06) ? MQTT_RX_PACKET_ID : MQTT_RX_PAYLOAD;
+    } else if (rx_state_ == MQTT_RX_PACKET_ID && rx_count_ == 2)
+    {
+        rx_state_ = MQTT_RX_PAYLOAD;
+    }
+    if (--rx_remaining_ == 0)
+    {
+        endPacket();
+    }
+}
+
+// The remaining length is known; set up for the variable header
+void EspMqttClient::startBody()
+{
+    rx_count_ = 0;
+    topic_len_ = 0;
+    payload_len_ = 0;
+    memset(body_, 0, sizeof(body_));
+    if (rx_remaining_ == 0)
+    {
+        endPacket();
+    } else if ((rx_header_ >> 4) == MQTT_PUBLISH)
+    {
+        rx_state_ = MQTT_RX_TOPIC_LEN;
+    } else
+    {
+        rx_state_ = MQTT_RX_BODY;
+    }
+}
+
+void EspMqttClient::endPacket()
+{
+    uint8_t type = rx_header_ >> 4;
+    rx_state_ = MQTT_RX_HEADER;
+    if (type == MQTT_PUBLISH)
+    {
+        topic_[topic_len_ < ESP_MQTT_TOPIC_MAX ? topic_len_ : ESP_MQTT_TOPIC_MAX] = '\0';
+        if (callback_)
+        {
+            callback_(topic_, payload_, payload_len_, context_);
+        }
+        return;
+    }
+    if (type == MQTT_PINGRESP)
+    {
+        ping_outstanding_ = false;
+    }
+    last_ack_ = type;
+}
@@ -0,0 +1,83 @@
+/*------------------------------------------------------------------------
+Minimal MQTT 3.1.1 client for SimpleESP8266
+
+Runs over the module's single TCP connection (connectTCP()).  Publishes
+are QoS 0 and are batched: each publish() only copies the packet into a
+small buffer, and the whole buffer goes out in one CIPSEND when it fills
+or when loop()/flush() is called.  Subscriptions are QoS 0 as well.
+Incoming PUBLISH packets are decoded a byte at a time as the +IPD data is
+read, so no packet-sized buffer is needed; topics and payloads longer
+than ESP_MQTT_TOPIC_MAX/ESP_MQTT_PAYLOAD_MAX are truncated.
+
+MIT license, all text above must be included in any redistribution.
+------------------------------------------------------------------------*/
+
+#ifndef EspMqtt_H
+#define EspMqtt_H
+#include "SimpleEsp8266.h"
+
+#define ESP_MQTT_KEEPALIVE    60       //Keep alive (in seconds) asked of the broker; loop() pings at half this
+#define ESP_MQTT_ACK_TIMEOUT  5000     //Time (in milliseconds) to wait for CONNACK/SUBACK
+#define ESP_MQTT_POLL_TIMEOUT 100      //Longest time (in milliseconds) loop() spends reading one piece of input
+#define ESP_MQTT_TX_BUFFER    128      //Bytes of outgoing packets collected per CIPSEND
+#define ESP_MQTT_RX_CHUNK     32       //Bytes read from the module at a time
+#define ESP_MQTT_TOPIC_MAX    64       //Longest incoming topic kept
+#define ESP_MQTT_PAYLOAD_MAX  64       //Longest incoming payload kept
+
+//Called from loop() (or while connect()/subscribe() wait) for each message
+//  received.  topic is NUL terminated.
+typedef void (*EspMqttCallback)(const char *topic, const uint8_t *payload, uint16_t len, void *context);
+
+class EspMqttClient
+{
+public:
+    EspMqttClient(SimpleESP8266 *esp);
+    boolean connect(EspStr *host, int port, EspStr *client_id,
+                    EspStr *user = NULL, EspStr *pass = NULL,
+                    uint16_t keepalive = ESP_MQTT_KEEPALIVE);
+    void    disconnect();
+    boolean connected();
+    boolean publish(const char *topic, const uint8_t *payload, uint16_t len);
+    boolean publish(EspStr *topic, const uint8_t *payload, uint16_t len);
+    boolean subscribe(EspStr *topic);
+    boolean flush();
+    boolean loop();
+    void    setCallback(EspMqttCallback callback, void *context = NULL);
+private:
+    SimpleESP8266 *esp_;
+    boolean   connected_;
+    uint32_t  keepalive_ms_;
+    uint32_t  last_tx_;      // millis() of the last send
+    uint32_t  ping_sent_;
+    boolean   ping_outstanding_;
+    uint16_t  packet_id_;
+    EspMqttCallback callback_;
+    void     *context_;
+    //Outgoing packets not yet sent
+    uint8_t   tx_[ESP_MQTT_TX_BUFFER];
+    uint16_t  tx_len_;
+    //Incoming packet decoder
+    uint8_t   rx_state_;
+    uint8_t   rx_header_;    // First byte of the packet being decoded
+    uint32_t  rx_remaining_; // Bytes of it still to come
+    uint8_t   rx_shift_;     // Position in the remaining length field
+    uint16_t  rx_count_;     // Bytes of the current field decoded
+    uint16_t  topic_len_;
+    char      topic_[ESP_MQTT_TOPIC_MAX + 1];
+    uint8_t   payload_[ESP_MQTT_PAYLOAD_MAX];
+    uint16_t  payload_len_;
+    uint8_t   body_[3];      // Start of any other packet (enough for CONNACK and SUBACK)
+    uint8_t   last_ack_;     // Type of the last non-PUBLISH packet received
+    void      put(const uint8_t *data, uint16_t len);
+    void      putByte(uint8_t c);
+    void      putP(EspStr *str, uint16_t len);
+    void      putHeader(uint8_t type, uint32_t remaining);
+    void      putStringP(EspStr *str);
+    boolean   waitFor(uint8_t type);
+    boolean   receive();
+    void      decode(uint8_t c);
+    void      startBody();
+    void      endPacket();
+};
+
+#endif // EspMqtt_H
@@ -0,0 +1,276 @@
+/*------------------------------------------------------------------------
+Several ESP8266 modules driven from one non-blocking loop
+
+MIT license, all text above must be included in any redistribution.
+------------------------------------------------------------------------*/
+
+#include "EspMulti.h"
+
+EspMultiModule::EspMultiModule(SimpleESP8266 *esp) :
+    esp_(esp), reset_(esp), join_(esp), connect_(esp), send_(esp), recv_(esp), state_(ESP_MODULE_IDLE),
+    joined_(true), connected_(false), failures_(0), t_wait_(0), data_(NULL), len_(0), sent_(0), resets_(0)
+{
+}
+
+SimpleESP8266 *EspMultiModule::esp()
+{
+    return esp_;
+}
+
+EspModuleState EspMultiModule::state()
+{
+    return state_;
+}
+
+boolean EspMultiModule::connected()
+{
+    return connected_;
+}
+
+uint32_t EspMultiModule::bytesSent()
+{
+    return sent_;
+}
+
+uint16_t EspMultiModule::resets()
+{
+    return resets_;
+}
+
+EspMulti::EspMulti() :
+    count_(0), next_(0), host_(NULL), port_(0), ssid_(NULL), pass_(NULL), callback_(NULL), context_(NULL),
+    recv_callback_(NULL), recv_context_(NULL)
+{
+}
+
+// Returns false if there are already ESP_MULTI_MAX_MODULES
+boolean EspMulti::add(EspMultiModule *module)
+{
+    if (count_ >= ESP_MULTI_MAX_MODULES)
+    {
+        return false;
+    }
+    modules_[count_++] = module;
+    return true;
+}
+
+// Set the server each module connects to, and optionally the access point
+// each joins first (and again after a reset).  The connections are opened
+// by loop().
+void EspMulti::begin(EspStr *host, int port, EspStr *ssid, EspStr *pass)
+{
+    host_ = host;
+    port_ = port;
+    ssid_ = ssid;
+    pass_ = pass;
+    for (uint8_t i = 0; i < count_; ++i)
+    {
+        modules_[i]->joined_ = (ssid == NULL);
+        modules_[i]->connected_ = false;
+    }
+}
+
+// Step every module's current operation once
+void EspMulti::loop()
+{
+    for (uint8_t i = 0; i < count_; ++i)
+    {
+        service(i);
+    }
+}
+
+// Start sending data on the next free module.  The data must stay valid
+// until the callback reports the send finished.  Returns the module's index,
+// or -1 if none is connected and idle (with nothing received left to read).
+int8_t EspMulti::send(const uint8_t *data, uint16_t len)
+{
+    for (uint8_t n = 0; n < count_; ++n)
+    {
+        uint8_t         i = (next_ + n) % count_;
+        EspMultiModule *module = modules_[i];
+        if (canSend(module))
+        {
+            module->data_ = data;
+            module->len_ = len;
+            module->send_.begin(data, len);
+            module->state_ = ESP_MODULE_SENDING;
+            next_ = i + 1;
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Number of modules that could take a send right now
+uint8_t EspMulti::ready()
+{
+    uint8_t n = 0;
+    for (uint8_t i = 0; i < count_; ++i)
+    {
+        if (canSend(modules_[i]))
+        {
+            n++;
+        }
+    }
+    return n;
+}
+
+// true if no send is in progress
+boolean EspMulti::idle()
+{
+    for (uint8_t i = 0; i < count_; ++i)
+    {
+        if (modules_[i]->state_ == ESP_MODULE_SENDING)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void EspMulti::setCallback(EspMultiCallback callback, void *context)
+{
+    callback_ = callback;
+    context_ = context;
+}
+
+void EspMulti::setRecvCallback(EspMultiRecvCallback callback, void *context)
+{
+    recv_callback_ = callback;
+    recv_context_ = context;
+}
+
+void EspMulti::service(uint8_t index)
+{
+    EspMultiModule *module = modules_[index];
+    EspStatus       status;
+    switch (module->state_)
+    {
+    case ESP_MODULE_IDLE:
+        if (!module->joined_)
+        {
+            module->join_.begin(ssid_, pass_);
+            module->state_ = ESP_MODULE_JOINING;
+        } else if (!module->connected_ && host_ != NULL)
+        {
+            startConnect(module);
+        } else if (module->connected_ && module->esp_->recvWaiting())
+        {
+            //Read what the server sent before the next send searches past it
+            module->recv_.begin(module->rx_, sizeof(module->rx_), ESP_MULTI_POLL_TIMEOUT);
+            module->state_ = ESP_MODULE_RECEIVING;
+        }
+        break;
+    case ESP_MODULE_JOINING:
+        status = module->join_.step();
+        if (status == ESP_DONE)
+        {
+            module->joined_ = true;
+            module->state_ = ESP_MODULE_IDLE;
+        } else if (status == ESP_ERROR)
+        {
+            failed(module);
+        }
+        break;
+    case ESP_MODULE_RECEIVING:
+        status = module->recv_.step();
+        if (status == ESP_PENDING)
+        {
+            break;
+        }
+        if (status == ESP_DONE && recv_callback_ != NULL)
+        {
+            recv_callback_(index, (const uint8_t *)module->rx_, module->recv_.length(), recv_context_);
+        }
+        //Not a failure if it was only a status line; but a "CLOSED" one
+        //  means the server hung up
+        if (!(module->esp_->openLinks() & 1))
+        {
+            module->connected_ = false;
+        }
+        module->state_ = ESP_MODULE_IDLE;
+        break;
+    case ESP_MODULE_CONNECTING:
+        status = module->connect_.step();
+        if (status == ESP_DONE)
+        {
+            //failures_ is only cleared by a send, which proves the link works
+            module->connected_ = true;
+            module->state_ = ESP_MODULE_IDLE;
+        } else if (status == ESP_ERROR)
+        {
+            failed(module);
+        }
+        break;
+    case ESP_MODULE_SENDING:
+        status = module->send_.step();
+        if (status == ESP_PENDING)
+        {
+            break;
+        }
+        if (status == ESP_DONE)
+        {
+            module->sent_ += module->len_;
+            module->failures_ = 0;
+            module->state_ = ESP_MODULE_IDLE;
+        } else
+        {
+            //The link is probably gone, so reconnect before sending again
+            failed(module);
+        }
+        if (callback_ != NULL)
+        {
+            callback_(index, module->data_, module->len_, status, context_);
+        }
+        break;
+    case ESP_MODULE_RESETTING:
+        status = module->reset_.step();
+        if (status == ESP_DONE)
+        {
+            //Rejoin rather than count on the module having saved the AP
+            module->joined_ = (ssid_ == NULL);
+            module->state_ = ESP_MODULE_IDLE;
+        } else if (status == ESP_ERROR)
+        {
+            module->state_ = ESP_MODULE_WAITING;
+            module->t_wait_ = millis();
+        }
+        break;
+    default:
+        if ((millis() - module->t_wait_) >= ESP_MULTI_RETRY_DELAY)
+        {
+            module->state_ = ESP_MODULE_IDLE;
+        }
+        break;
+    }
+}
+
+// Received data is read by loop() first, or the send would skip over it
+boolean EspMulti::canSend(EspMultiModule *module)
+{
+    return module->state_ == ESP_MODULE_IDLE && module->connected_ && !module->esp_->recvWaiting();
+}
+
+void EspMulti::startConnect(EspMultiModule *module)
+{
+    module->connect_.begin(host_, port_);
+    module->state_ = ESP_MODULE_CONNECTING;
+}
+
+// A connect or send failed: wait and try again, or reset the module if
+// that keeps happening
+void EspMulti::failed(EspMultiModule *module)
+{
+    module->connected_ = false;
+    if (++module->failures_ >= ESP_MULTI_MAX_FAILURES)
+    {
+        module->failures_ = 0;
+        module->resets_++;
+        module->reset_.restart();
+        module->state_ = ESP_MODULE_RESETTING;
+    } else
+    {
+        module->state_ = ESP_MODULE_WAITING;
+        module->t_wait_ = millis();
+    }
+}
@@ -0,0 +1,126 @@
+/*------------------------------------------------------------------------
+Several ESP8266 modules driven from one non-blocking loop
+
+EspMulti opens a connection to the same server on each module and shares
+outbound sends between them, so traffic uses every radio at once instead
+of one module's worth.  Each module is driven by its own tasks (see
+SimpleEsp8266Tasks.h) and loop() steps all of them, so while one UART
+waits for SEND OK the others keep moving data.
+
+    SimpleESP8266  esp1(&Serial1), esp2(&Serial2);
+    EspMultiModule radio1(&esp1), radio2(&esp2);
+    EspMulti       radios;
+
+    radios.add(&radio1);
+    radios.add(&radio2);
+    radios.begin(F("10.0.0.2"), 5000, F("ssid"), F("password"));
+    ...
+    radios.loop();
+    if (radios.send(data, len) < 0) { ... all busy, try again later ... }
+
+A send goes to the next idle, connected module with nothing received
+waiting to be read.  When a connect or send
+fails the module reconnects; after ESP_MULTI_MAX_FAILURES failures in a
+row it is reset, and sends carry on over the others meanwhile.  A failed
+send is reported to the callback, not retried, because part of it may
+already have been delivered.  Given the access point, each module joins
+it before connecting and again after every reset; without one, join it
+on each module first and keep it saved (setPersistAP(true)) so a reset
+module can rejoin by itself.
+
+Data the server sends is read by loop() before a module takes another
+send, and handed to the receive callback a piece at a time (or dropped if
+there is none).  Data that arrives during a send is lost: the module's
+replies are searched for past it.
+
+MIT license, all text above must be included in any redistribution.
+------------------------------------------------------------------------*/
+
+#ifndef EspMulti_H
+#define EspMulti_H
+#include "SimpleEsp8266Tasks.h"
+
+#define ESP_MULTI_MAX_MODULES   3
+#define ESP_MULTI_MAX_FAILURES  2      //Failed connects/sends in a row before a module is reset
+#define ESP_MULTI_RETRY_DELAY   1000   //Time (in milliseconds) before a failed connect is tried again
+#define ESP_MULTI_RX_CHUNK      32     //Bytes of received data passed to the receive callback at a time, per module
+#define ESP_MULTI_POLL_TIMEOUT  100    //Longest time (in milliseconds) a module waits for a +IPD frame once input is seen
+
+// What a module is doing
+enum EspModuleState
+{
+    ESP_MODULE_IDLE = 0,        //Ready for a send if connected
+    ESP_MODULE_CONNECTING,
+    ESP_MODULE_SENDING,
+    ESP_MODULE_RESETTING,
+    ESP_MODULE_WAITING,         //Waiting to try connecting again
+    ESP_MODULE_JOINING,         //Joining the access point
+    ESP_MODULE_RECEIVING
+};
+
+//Called when a send finishes on a module (status is ESP_DONE or ESP_ERROR)
+typedef void (*EspMultiCallback)(uint8_t module, const uint8_t *data, uint16_t len, EspStatus status, void *context);
+//Called with each piece of data received on a module
+typedef void (*EspMultiRecvCallback)(uint8_t module, const uint8_t *data, uint16_t len, void *context);
+
+// One module's place in an EspMulti
+class EspMultiModule
+{
+public:
+    EspMultiModule(SimpleESP8266 *esp);
+    SimpleESP8266 *esp();
+    EspModuleState state();
+    boolean        connected();
+    uint32_t       bytesSent();
+    uint16_t       resets();
+private:
+    friend class EspMulti;
+    SimpleESP8266    *esp_;
+    EspResetTask      reset_;
+    EspConnectAPTask  join_;
+    EspConnectTCPTask connect_;
+    EspSendTask       send_;
+    EspRecvTask       recv_;
+    char              rx_[ESP_MULTI_RX_CHUNK];
+    EspModuleState    state_;
+    boolean           joined_;     // On the access point, as far as we know
+    boolean           connected_;
+    uint8_t           failures_;   // Failed operations in a row
+    uint32_t          t_wait_;     // millis() when ESP_MODULE_WAITING started
+    const uint8_t    *data_;       // The send in progress
+    uint16_t          len_;
+    uint32_t          sent_;       // Bytes delivered
+    uint16_t          resets_;
+};
+
+class EspMulti
+{
+public:
+    EspMulti();
+    boolean add(EspMultiModule *module);
+    void    begin(EspStr *host, int port, EspStr *ssid = NULL, EspStr *pass = NULL);
+    void    loop();
+    int8_t  send(const uint8_t *data, uint16_t len);
+    uint8_t ready();
+    boolean idle();
+    void    setCallback(EspMultiCallback callback, void *context = NULL);
+    void    setRecvCallback(EspMultiRecvCallback callback, void *context = NULL);
+private:
+    EspMultiModule  *modules_[ESP_MULTI_MAX_MODULES];
+    uint8_t          count_;
+    uint8_t          next_;       // Where the search for a free module starts, to spread sends
+    EspStr          *host_;
+    int              port_;
+    EspStr          *ssid_;
+    EspStr          *pass_;
+    EspMultiCallback callback_;
+    void            *context_;
+    EspMultiRecvCallback recv_callback_;
+    void            *recv_context_;
+    void             service(uint8_t index);
+    boolean          canSend(EspMultiModule *module);
+    void             startConnect(EspMultiModule *module);
+    void             failed(EspMultiModule *module);
+};
+
+#endif // EspMulti_H
@@ -0,0 +1,635 @@
+/*------------------------------------------------------------------------
+WebSocket server for SimpleESP8266
+
+MIT license, all text above must be included in any redistribution.
+------------------------------------------------------------------------*/
+
+#include "EspWebSocket.h"
+
+#define WS_NO_LINK            0xFF
+
+//Client::match values besides a count of matched characters
+#define WS_MATCH_NONE         0xFF     //This line isn't the key header
+#define WS_MATCH_VALUE        0xFE     //Reading the key header's value
+
+//Client::pending bits
+#define WS_SEND_ACCEPT        0x01
+#define WS_SEND_REJECT        0x02
+#define WS_SEND_PONG          0x04
+#define WS_SEND_CLOSE         0x08
+
+//Frame decoder states
+#define WS_FRAME_HEADER       0
+#define WS_FRAME_LENGTH7      1
+#define WS_FRAME_LENGTH       2
+#define WS_FRAME_MASK         3
+#define WS_FRAME_DATA         4
+
+static const char key_header[] PROGMEM = "sec-websocket-key:";
+static const char key_guid[] PROGMEM = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+static const char accept_reply[] PROGMEM =
+    "HTTP/1.1 101 Switching Protocols\r\n"
+    "Upgrade: websocket\r\n"
+    "Connection: Upgrade\r\n"
+    "Sec-WebSocket-Accept: ";
+static const char reject_reply[] PROGMEM = "HTTP/1.1 400 Bad Request\r\n\r\n";
+static const char base64_chars[] PROGMEM = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// SHA-1, only as much as the handshake needs (messages under 512MB)
+struct Sha1
+{
+    uint32_t h[5];
+    union
+    {
+        uint8_t  block[64];
+        uint32_t w[16];    // The block as words, worked on in place
+    };
+    uint8_t  used;
+    uint32_t length;
+};
+
+static void sha1Init(Sha1 *sha)
+{
+    sha->h[0] = 0x67452301;
+    sha->h[1] = 0xEFCDAB89;
+    sha->h[2] = 0x98BADCFE;
+    sha->h[3] = 0x10325476;
+    sha->h[4] = 0xC3D2E1F0;
+    sha->used = 0;
+    sha->length = 0;
+}
+
+static uint32_t rol(uint32_t x, uint8_t n)
+{
+    return (x << n) | (x >> (32 - n));
+}
+
+static void sha1Block(Sha1 *sha)
+{
+    uint32_t *w = sha->w;
+    uint32_t a = sha->h[0], b = sha->h[1], c = sha->h[2], d = sha->h[3], e = sha->h[4];
+    for (uint8_t i = 0; i < 16; ++i)
+    {
+        //Big endian bytes to words, overwriting the block
+        const uint8_t *p = sha->block + 4 * i;
+        w[i] = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+    }
+    for (uint8_t i = 0; i < 80; ++i)
+    {
+        uint32_t f, k, t;
+        if (i >= 16)
+        {
+            //The message schedule only ever looks back 16 words
+            w[i & 15] = rol(w[(i + 13) & 15] ^ w[(i + 8) & 15] ^ w[(i + 2) & 15] ^ w[i & 15], 1);
+        }
+        if (i < 20)
+        {
+            f = (b & c) | (~b & d);
+            k = 0x5A827999;
+        } else if (i < 40)
+        {
+            f = b ^ c ^ d;
+            k = 0x6ED9EBA1;
+        } else if (i < 60)
+        {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8F1BBCDC;
+        } else
+        {
+            f = b ^ c ^ d;
+            k = 0xCA62C1D6;
+        }
+        t = rol(a, 5) + f + e + k + w[i & 15];
+        e = d;
+        d = c;
+        c = rol(b, 30);
+        b = a;
+        a = t;
+    }
+    sha->h[0] += a;
+    sha->h[1] += b;
+    sha->h[2] += c;
+    sha->h[3] += d;
+    sha->h[4] += e;
+    sha->used = 0;
+}
+
+static void sha1Byte(Sha1 *sha, uint8_t c)
+{
+    sha->block[sha->used++] = c;
+    sha->length++;
+    if (sha->used == 64)
+    {
+        sha1Block(sha);
+    }
+}
+
+static void sha1Final(Sha1 *sha, uint8_t *digest)
+{
+    uint32_t bits = sha->length << 3;
+    sha->block[sha->used++] = 0x80;
+    if (sha->used > 56)
+    {
+        memset(sha->block + sha->used, 0, 64 - sha->used);
+        sha1Block(sha);
+    }
+    memset(sha->block + sha->used, 0, 60 - sha->used);
+    sha->block[60] = bits >> 24;
+    sha->block[61] = bits >> 16;
+    sha->block[62] = bits >> 8;
+    sha->block[63] = bits;
+    sha1Block(sha);
+    for (uint8_t i = 0; i < 20; ++i)
+    {
+        digest[i] = sha->h[i >> 2] >> (24 - 8 * (i & 3));
+    }
+}
+
+// Base64 of len bytes into out, padded with '='.  Returns the length.
+static uint8_t base64(const uint8_t *data, uint8_t len, char *out)
+{
+    uint8_t n = 0;
+    for (uint8_t i = 0; i < len; i += 3)
+    {
+        uint32_t v = (uint32_t)data[i] << 16;
+        if (i + 1 < len)
+        {
+            v |= (uint32_t)data[i + 1] << 8;
+        }
+        if (i + 2 < len)
+        {
+            v |= data[i + 2];
+        }
+        out[n++] = pgm_read_byte(base64_chars + ((v >> 18) & 0x3F));
+        out[n++] = pgm_read_byte(base64_chars + ((v >> 12) & 0x3F));
+        out[n++] = (i + 1 < len) ? pgm_read_byte(base64_chars + ((v >> 6) & 0x3F)) : '=';
+        out[n++] = (i + 2 < len) ? pgm_read_byte(base64_chars + (v & 0x3F)) : '=';
+    }
+    return n;
+}
+
+EspWebSocketServer::EspWebSocketServer(SimpleESP8266 *esp) :
+    esp_(esp), reject_(0), control_len_(0), control_link_(WS_NO_LINK), callback_(NULL), context_(NULL)
+{
+    for (uint8_t i = 0; i < ESP_WS_MAX_CLIENTS; ++i)
+    {
+        clients_[i].link = WS_NO_LINK;
+    }
+}
+
+// Call often.  Reads whatever the module has received, answers upgrade
+// requests and pings, and passes messages to the callback.  A connection
+// the peer closes frees its slot here; to free the slots of peers that
+// vanish without closing, set the module's keepalive (see
+// SimpleESP8266::setKeepalive()).
+boolean EspWebSocketServer::loop()
+{
+    uint8_t chunk[ESP_WS_RX_CHUNK];
+    uint8_t open;
+    while (esp_->recvWaiting())
+    {
+        esp_->setDeadline(millis() + ESP_WS_POLL_TIMEOUT);
+        int32_t len = esp_->tcpRecv((char *)chunk, sizeof(chunk));
+        if (len <= 0)
+        {
+            break;
+        }
+        uint8_t link = esp_->lastLinkId();
+        Client *client = clientFor(link, true);
+        if (!client)
+        {
+            if (link < ESP_MAX_LINKS)
+            {
+                reject_ |= 1 << link;
+            }
+            continue;
+        }
+        uint8_t i = 0;
+        while (!client->open && i < len)
+        {
+            handshake(client, chunk[i++]);
+        }
+        if (client->open && i < len)
+        {
+            frame(client, chunk + i, len - i);
+        }
+    }
+
+    //Pick up "<link>,CLOSED" lines left after the data (this also runs
+    //  the keepalive, if set), then forget the links that have gone
+    esp_->serviceLinks();
+    open = esp_->openLinks();
+    for (uint8_t i = 0; i < ESP_WS_MAX_CLIENTS; ++i)
+    {
+        if (clients_[i].link != WS_NO_LINK && !(open & (1 << clients_[i].link)))
+        {
+            clients_[i].link = WS_NO_LINK;
+            clients_[i].open = false;
+        }
+    }
+
+    //Only reply once the input is read: a command sent mid +IPD frame
+    //  would swallow the rest of it
+    for (uint8_t i = 0; i < ESP_WS_MAX_CLIENTS; ++i)
+    {
+        if (clients_[i].link != WS_NO_LINK && clients_[i].pending)
+        {
+            sendPending(&clients_[i]);
+        }
+    }
+    control_link_ = WS_NO_LINK;
+    for (uint8_t link = 0; reject_ && link < ESP_MAX_LINKS; ++link)
+    {
+        if (reject_ & (1 << link))
+        {
+            esp_->closeLink(link);
+            reject_ &= ~(1 << link);
+        }
+    }
+    return true;
+}
+
+// Send one unfragmented message.  Returns false (and forgets the
+// connection) if it couldn't be sent.
+boolean EspWebSocketServer::send(uint8_t link, const uint8_t *data, uint16_t len, uint8_t opcode)
+{
+    Client *client = clientFor(link, false);
+    uint8_t header[4];
+    uint8_t header_len = 2;
+    if (!client || !client->open)
+    {
+        return false;
+    }
+    //Server frames are not masked
+    header[0] = 0x80 | opcode;
+    if (len < 126)
+    {
+        header[1] = len;
+    } else
+    {
+        header[1] = 126;
+        header[2] = len >> 8;
+        header[3] = len & 0xFF;
+        header_len = 4;
+    }
+    if (!esp_->tcpSend(data, len, link, header, header_len))
+    {
+        drop(client);
+        return false;
+    }
+    return true;
+}
+
+// Send a message to every open connection.  Returns how many it reached.
+uint8_t EspWebSocketServer::broadcast(const uint8_t *data, uint16_t len, uint8_t opcode)
+{
+    uint8_t sent = 0;
+    for (uint8_t i = 0; i < ESP_WS_MAX_CLIENTS; ++i)
+    {
+        if (clients_[i].link != WS_NO_LINK && clients_[i].open &&
+            send(clients_[i].link, data, len, opcode))
+        {
+            sent++;
+        }
+    }
+    return sent;
+}
+
+boolean EspWebSocketServer::ping(uint8_t link)
+{
+    return send(link, NULL, 0, ESP_WS_PING);
+}
+
+// Say goodbye and close the connection
+void EspWebSocketServer::close(uint8_t link)
+{
+    Client *client = clientFor(link, false);
+    if (client)
+    {
+        if (client->open)
+        {
+            send(link, NULL, 0, ESP_WS_CLOSE);
+        }
+        drop(client);
+    }
+}
+
+boolean EspWebSocketServer::isOpen(uint8_t link)
+{
+    Client *client = clientFor(link, false);
+    return client && client->open;
+}
+
+void EspWebSocketServer::setCallback(EspWsCallback callback, void *context)
+{
+    callback_ = callback;
+    context_ = context;
+}
+
+// The slot for a link, optionally claiming a free one for a new connection
+EspWebSocketServer::Client *EspWebSocketServer::clientFor(uint8_t link, boolean create)
+{
+    Client *free_slot = NULL;
+    for (uint8_t i = 0; i < ESP_WS_MAX_CLIENTS; ++i)
+    {
+        if (clients_[i].link == link)
+        {
+            return &clients_[i];
+        }
+        if (clients_[i].link == WS_NO_LINK && !free_slot)
+        {
+            free_slot = &clients_[i];
+        }
+    }
+    if (!create || !free_slot || link >= ESP_MAX_LINKS)
+    {
+        return NULL;
+    }
+    memset(free_slot, 0, sizeof(*free_slot));
+    free_slot->link = link;
+    return free_slot;
+}
+
+// Feed one byte of the upgrade request.  Only the Sec-WebSocket-Key
+// header matters; everything else is skipped as it goes by.
+void EspWebSocketServer::handshake(Client *client, uint8_t c)
+{
+    if (client->pending)
+    {
+        return;   //Already answered, ignore anything else
+    }
+    if (c == '\n')
+    {
+        if (client->line_len == 0)
+        {
+            //Blank line: end of the request
+            client->pending = (client->key_len == sizeof(client->key)) ? WS_SEND_ACCEPT : WS_SEND_REJECT;
+        }
+        client->line_len = 0;
+        client->match = 0;
+        return;
+    }
+    if (c == '\r')
+    {
+        return;
+    }
+    if (client->line_len < 0xFF)
+    {
+        client->line_len++;
+    }
+    if (client->match == WS_MATCH_VALUE)
+    {
+        if (c != ' ')
+        {
+            if (client->key_len < sizeof(client->key))
+            {
+                client->key[client->key_len] = c;
+            }
+            if (client->key_len < 0xFF)
+            {
+                client->key_len++;
+            }
+        }
+    } else if (client->match != WS_MATCH_NONE)
+    {
+        //Header names aren't case sensitive
+        if ((c | 0x20) == pgm_read_byte(key_header + client->match))
+        {
+            if (++client->match == sizeof(key_header) - 1)
+            {
+                client->match = WS_MATCH_VALUE;
+                client->key_len = 0;
+            }
+        } else
+        {
+            client->match = WS_MATCH_NONE;
+        }
+    }
+}
+
+// Decode frame bytes, unmasking the payload in place
+void EspWebSocketServer::frame(Client *client, uint8_t *data, uint16_t len)
+{
+    uint16_t i = 0;
+    while (i < len && client->link != WS_NO_LINK)
+    {
+        uint8_t c = data[i];
+        switch (client->frame_state)
+        {
+        case WS_FRAME_HEADER:
+            if (c == 'G')
+            {
+                //Not a valid frame (opcode 7 is reserved) but the "GET " of
+                //  a new connection on a link whose close went unseen:
+                //  start over with its upgrade request
+                uint8_t link = client->link;
+                memset(client, 0, sizeof(*client));
+                client->link = link;
+                while (i < len)
+                {
+                    handshake(client, data[i++]);
+                }
+                return;
+            }
+            client->header = c;
+            client->frame_state = WS_FRAME_LENGTH7;
+            i++;
+            break;
+        case WS_FRAME_LENGTH7:
+            if (!(c & 0x80))
+            {
+                //Clients must mask; anything else ends the connection
+                client->pending |= WS_SEND_CLOSE;
+                client->frame_state = WS_FRAME_HEADER;
+                return;
+            }
+            c &= 0x7F;
+            if (c >= 126)
+            {
+                //pos counts down the bytes of the extended length
+                client->pos = (c == 126) ? 2 : 8;
+                client->remaining = 0;
+                client->frame_state = WS_FRAME_LENGTH;
+            } else
+            {
+                client->pos = 0;
+                client->remaining = c;
+                client->frame_state = WS_FRAME_MASK;
+            }
+            i++;
+            break;
+        case WS_FRAME_LENGTH:
+            client->remaining = (client->remaining << 8) | c;
+            if (--client->pos == 0)
+            {
+                client->frame_state = WS_FRAME_MASK;
+            }
+            i++;
+            break;
+        case WS_FRAME_MASK:
+            client->mask[client->pos++] = c;
+            i++;
+            if (client->pos == 4)
+            {
+                client->pos = 0;
+                client->frame_state = WS_FRAME_DATA;
+                if (client->header & 0x08)
+                {
+                    startControl(client);
+                }
+                if ((client->header & 0x0F) != ESP_WS_CONTINUATION && !(client->header & 0x08))
+                {
+                    client->message = client->header & 0x0F;
+                }
+                if (client->remaining == 0)
+                {
+                    endFrame(client);
+                }
+            }
+            break;
+        default:
+        {
+            uint16_t run = len - i;
+            if (run > client->remaining)
+            {
+                run = client->remaining;
+            }
+            for (uint16_t j = 0; j < run; ++j)
+            {
+                data[i + j] ^= client->mask[client->pos++ & 3];
+            }
+            client->remaining -= run;
+            if (client->header & 0x08)
+            {
+                //Control frame: keep the payload for the reply
+                for (uint16_t j = 0; j < run && control_len_ < ESP_WS_CONTROL_MAX; ++j)
+                {
+                    control_[control_len_++] = data[i + j];
+                }
+            } else if (callback_)
+            {
+                callback_(client->link, client->message, data + i, run,
+                          client->remaining == 0 && (client->header & 0x80), context_);
+            }
+            i += run;
+            if (client->remaining == 0)
+            {
+                endFrame(client);
+            }
+            break;
+        }
+        }
+    }
+}
+
+// A control frame's payload is about to go in control_.  Replies are only
+// sent once loop() has read everything waiting, so if another connection's
+// ping (or close) is still unanswered it loses its payload: the pong is
+// skipped, a close goes without its status code.  Each connection keeps
+// its own most recent ping, as RFC 6455 allows.
+void EspWebSocketServer::startControl(Client *client)
+{
+    if (control_link_ != WS_NO_LINK && control_link_ != client->link)
+    {
+        Client *owner = clientFor(control_link_, false);
+        if (owner)
+        {
+            owner->pending &= ~WS_SEND_PONG;
+        }
+    }
+    control_len_ = 0;
+    control_link_ = client->link;
+}
+
+void EspWebSocketServer::endFrame(Client *client)
+{
+    switch (client->header & 0x0F)
+    {
+    case ESP_WS_PING:
+        client->pending |= WS_SEND_PONG;
+        break;
+    case ESP_WS_CLOSE:
+        //Its payload replaces any ping's, and there's no need for a pong
+        //  on a connection that's closing
+        client->pending = (client->pending & ~WS_SEND_PONG) | WS_SEND_CLOSE;
+        break;
+    default:
+        break;
+    }
+    client->frame_state = WS_FRAME_HEADER;
+}
+
+void EspWebSocketServer::sendPending(Client *client)
+{
+    uint8_t pending = client->pending;
+    uint8_t link = client->link;
+    //The control frame payload, if this connection sent the last one
+    uint8_t control_len = (control_link_ == link) ? control_len_ : 0;
+    client->pending = 0;
+    if (pending & WS_SEND_ACCEPT)
+    {
+        client->open = sendAccept(client);
+        if (!client->open)
+        {
+            drop(client);
+            return;
+        }
+    }
+    if (pending & WS_SEND_REJECT)
+    {
+        esp_->tcpSendP((EspStr *)reject_reply, NULL, 0, link);
+        drop(client);
+        return;
+    }
+    if (pending & WS_SEND_PONG)
+    {
+        send(link, control_, control_len, ESP_WS_PONG);
+    }
+    if (pending & WS_SEND_CLOSE)
+    {
+        //Echo the status code, if any, then hang up
+        send(link, control_, control_len < 2 ? control_len : 2, ESP_WS_CLOSE);
+        drop(client);
+    }
+}
+
+// Reply to the upgrade request.  Sec-WebSocket-Accept is the base64 SHA-1
+// of the client's key followed by a fixed GUID.  One CIPSEND carries the
+// fixed part straight from flash and then the key and blank line (32 bytes
+// of RAM), so the SHA-1 state (about 90 bytes, the message block doubling
+// as its schedule) is the largest thing on the stack.
+boolean EspWebSocketServer::sendAccept(Client *client)
+{
+    uint8_t accept[28 + 4];
+    uint8_t digest[20];
+    uint8_t len;
+    {
+        Sha1 sha;
+        sha1Init(&sha);
+        for (uint8_t i = 0; i < sizeof(client->key); ++i)
+        {
+            sha1Byte(&sha, client->key[i]);
+        }
+        for (uint8_t i = 0; i < sizeof(key_guid) - 1; ++i)
+        {
+            sha1Byte(&sha, pgm_read_byte(key_guid + i));
+        }
+        sha1Final(&sha, digest);
+    }
+    len = base64(digest, sizeof(digest), (char *)accept);
+    memcpy_P(accept + len, PSTR("\r\n\r\n"), 4);
+    return esp_->tcpSendP((EspStr *)accept_reply, accept, len + 4, client->link);
+}
+
+// Forget a connection and close it
+void EspWebSocketServer::drop(Client *client)
+{
+    uint8_t link = client->link;
+    if (link == WS_NO_LINK)
+    {
+        return;
+    }
+    client->link = WS_NO_LINK;
+    client->open = false;
+    esp_->closeLink(link);
+}
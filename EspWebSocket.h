@@ -0,0 +1,90 @@
+/*------------------------------------------------------------------------
+WebSocket server for SimpleESP8266
+
+Set the module up as a TCP server first (setupTcpServer() or acceptTCP()),
+then call loop() often.  Browsers connect to ws://<module ip>:<port>/.
+Each connection's HTTP upgrade request is parsed as it arrives; only the
+Sec-WebSocket-Key is kept, and the SHA-1 for the reply is worked out when
+the headers end.  Frames are unmasked in place as they are read and handed
+to the callback in pieces, so a message of any length needs no buffer.
+Pings are answered automatically.
+
+The callback runs while a +IPD frame is only partly read, so it mustn't
+send; note what to send and do it after loop() returns.
+
+MIT license, all text above must be included in any redistribution.
+------------------------------------------------------------------------*/
+
+#ifndef EspWebSocket_H
+#define EspWebSocket_H
+#include "SimpleEsp8266.h"
+
+#define ESP_WS_MAX_CLIENTS    2        //WebSocket connections served at once; others are closed
+#define ESP_WS_RX_CHUNK       32       //Bytes read from the module at a time
+#define ESP_WS_POLL_TIMEOUT   100      //Longest time (in milliseconds) loop() spends reading one piece of input
+#define ESP_WS_CONTROL_MAX    125      //Ping payload bytes kept to echo in the pong (125 is the most a ping may carry); one buffer serves every connection
+
+//Frame opcodes
+#define ESP_WS_CONTINUATION   0x0
+#define ESP_WS_TEXT           0x1
+#define ESP_WS_BINARY         0x2
+#define ESP_WS_CLOSE          0x8
+#define ESP_WS_PING           0x9
+#define ESP_WS_PONG           0xA
+
+//Called with each piece of a received message.  opcode is ESP_WS_TEXT or
+//  ESP_WS_BINARY (also for later fragments), and end is true on the last
+//  piece of the message.
+typedef void (*EspWsCallback)(uint8_t link, uint8_t opcode, const uint8_t *data, uint16_t len, boolean end, void *context);
+
+class EspWebSocketServer
+{
+public:
+    EspWebSocketServer(SimpleESP8266 *esp);
+    boolean loop();
+    boolean send(uint8_t link, const uint8_t *data, uint16_t len, uint8_t opcode = ESP_WS_TEXT);
+    uint8_t broadcast(const uint8_t *data, uint16_t len, uint8_t opcode = ESP_WS_TEXT);
+    boolean ping(uint8_t link);
+    void    close(uint8_t link);
+    boolean isOpen(uint8_t link);
+    void    setCallback(EspWsCallback callback, void *context = NULL);
+private:
+    // One connection, from the upgrade request on
+    struct Client
+    {
+        uint8_t  link;         // 0xFF when the slot is free
+        boolean  open;         // Handshake done
+        uint8_t  pending;      // Replies to send once the input is read
+        //Upgrade request
+        uint8_t  match;        // Characters of the key header's name matched on this line
+        uint8_t  line_len;
+        uint8_t  key_len;
+        char     key[24];
+        //Frame decoder
+        uint8_t  frame_state;
+        uint8_t  header;       // FIN bit and opcode of the current frame
+        uint8_t  message;      // Opcode of the message being received
+        uint8_t  mask[4];
+        uint8_t  pos;          // Bytes of the length or mask field read, or index into mask
+        uint32_t remaining;    // Bytes of the length field (while reading it) or payload to come
+    };
+    SimpleESP8266 *esp_;
+    Client    clients_[ESP_WS_MAX_CLIENTS];
+    uint8_t   reject_;       // Bit per link to close for want of a free slot
+    //Payload of the last control frame, to echo in the pong or close reply
+    uint8_t   control_[ESP_WS_CONTROL_MAX];
+    uint8_t   control_len_;
+    uint8_t   control_link_; // Whose it is, until the reply is sent
+    EspWsCallback callback_;
+    void     *context_;
+    Client   *clientFor(uint8_t link, boolean create);
+    void      handshake(Client *client, uint8_t c);
+    void      frame(Client *client, uint8_t *data, uint16_t len);
+    void      startControl(Client *client);
+    void      endFrame(Client *client);
+    void      sendPending(Client *client);
+    boolean   sendAccept(Client *client);
+    void      drop(Client *client);
+};
+
+#endif // EspWebSocket_H
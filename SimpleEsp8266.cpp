@@ -14,7 +14,7 @@ Written by Limor Fried and Phil Burgess for Adafruit Industries.
 MIT license, all text above must be included in any redistribution.
 ------------------------------------------------------------------------*/
 
-#include "SimpleESP8266.h"
+#include "SimpleEsp8266.h"
 
 //#define DEBUG_ENABLED
 #ifdef DEBUG_ENABLED
@@ -29,12 +29,49 @@ const char no_debug_string[] PROGMEM  = "DBGOFF";
 //  strlen_P. Casting the value to Pchr allows strlen_P to read the value
 typedef const PROGMEM char        Pchr;
 
+//Progress of scanLinkEvent() through a line
+#define EVENT_LINE_START      0
+#define EVENT_COMMA           1
+#define EVENT_C               2
+#define EVENT_WORD            3
+#define EVENT_SKIP            4        //Rest of any other line
+#define EVENT_TAIL            5        //Rest of an event line
+#define EVENT_IPD             6        //"+IPD,"
+#define EVENT_IPD_HEADER      7        //"[<id>,]<len>[,<remote IP>,<remote port>]:"
+#define EVENT_IPD_DATA        8
+
+//Fixed parts of the request sent by requestURL(), and their total length
+//  worked out at compile time
+#define ESP_HTTP_GET   "GET "
+#define ESP_HTTP_HOST  " HTTP/1.1\r\nHost: "
+#define ESP_HTTP_END   "\r\n\r\n"
+static const uint16_t http_overhead = sizeof(ESP_HTTP_GET ESP_HTTP_HOST ESP_HTTP_END) - 1;
+
 // Constructor
 SimpleESP8266::SimpleESP8266(Stream *stream, Stream *debug, int8_t reset_pin) :
-    stream_(stream), debug_(debug), reset_pin_(reset_pin), host_(NULL), writing_(false)
+    stream_(stream), debug_(debug), reset_pin_(reset_pin), host_(NULL), writing_(false),
+    mux_(false), ipd_link_(0), ipd_remaining_(0), ipd_remote_ip_(0), ipd_remote_port_(0), links_open_(0), links_probed_(0),
+    event_state_(0), event_link_(0), event_skip_(0), keepalive_idle_(ESP_KEEPALIVE_IDLE), keepalive_dead_(ESP_KEEPALIVE_DEAD),
+    keepalive_probe_(NULL), keepalive_probe_len_(0), link_callback_(NULL), link_context_(NULL), rssi_(0),
+    monitor_interval_(ESP_MONITOR_INTERVAL), last_monitor_(0), asleep_(false), wake_start_(0),
+    caps_(0), at_version_(0), passive_(false), persist_ap_(true),
+    softap_ssid_(NULL), softap_pass_(NULL), softap_channel_(ESP_SOFTAP_CHANNEL),
+    command_budget_(ESP_COMMAND_BUDGET), deadline_(0), deadline_set_(false), deadline_active_(false),
+    op_depth_(0), last_result_(ESP_RESULT_OK),
+    idle_strategy_(ESP_IDLE_SPIN), idle_callback_(NULL), idle_context_(NULL),
+    tx_buf_(NULL), tx_size_(0), tx_head_(0), tx_tail_(0), tx_from_isr_(false), tx_unsized_(0),
+    tx_callback_(NULL), tx_context_(NULL), baud_callback_(NULL), baud_context_(NULL)
 {
+    memset(&wake_stats_, 0, sizeof(wake_stats_));
+    memset(&bridge_stats_, 0, sizeof(bridge_stats_));
+    memset(link_rx_, 0, sizeof(link_rx_));
+    memset(link_probe_, 0, sizeof(link_probe_));
     setDefaultTimeouts();
     indent_ = "  ";
+    for (uint8_t link = 0; link < ESP_MAX_LINKS; ++link)
+    {
+        resetLinkStats(link);
+    }
 };
 
 // Override various timings.  Passing 0 for an item keeps current setting.
@@ -102,26 +139,258 @@ size_t SimpleESP8266::write(uint8_t c)
 {
     if (!writing_)
     {
-        //the module often falls behind if we transmit too fast, so before starting any transmission sleep for a bit
-        delay(10);
-        writing_ = true;
-        if (debug_)
-        {
-            debug_->print(DEBUG_STR("\r\n"));
-            debug_->print(indent_);
-            debug_->print(DEBUG_STR("-S->"));
-        }
+        startTransmission(true);
     }
     if (debug_)
     {
         escapedDebugWrite(c);
     }
+    if (tx_buf_)
+    {
+        queueBytes(&c, 1);
+        return 1;
+    }
     return stream_->write(c);
 }
 
+// Bulk version of the above, so a whole buffer costs one call rather than
+// one per byte.  Print routes print(number) and print(char*) through here.
+size_t SimpleESP8266::write(const uint8_t *buffer, size_t size)
+{
+    if (size == 0)
+    {
+        return 0;
+    }
+    if (!writing_)
+    {
+        startTransmission(true);
+    }
+    if (debug_)
+    {
+        for (size_t i = 0; i < size; ++i)
+        {
+            escapedDebugWrite(buffer[i]);
+        }
+    }
+    if (tx_buf_)
+    {
+        queueBytes(buffer, size);
+        return size;
+    }
+    return stream_->write(buffer, size);
+}
+
+// Give the library a transmit queue.  From then on everything written to
+// the module is copied into buffer and write() returns at once, unless the
+// queue is full.  serviceTx() hands the bytes to the UART as it has room
+// for them; the library calls it while waiting for responses, and the
+// tasks call it on every step().  Pass from_interrupt = true to drain the
+// queue only from your own serviceTx() calls, e.g. in a timer interrupt.
+// Pass NULL to go back to writing directly (any queued bytes are sent
+// first).  serviceTx() only writes what availableForWrite() says fits, so a
+// stream that doesn't implement it (e.g. SoftwareSerial, which always says
+// 0) needs unsized_bytes, e.g. ESP_TX_SERVICE_BYTES: how many bytes to
+// write per call anyway, blocking while they go out.
+void SimpleESP8266::setTxQueue(uint8_t *buffer, uint16_t size, boolean from_interrupt, uint8_t unsized_bytes)
+{
+    flushTx();
+#if defined(__AVR__)
+    uint8_t sreg = SREG;
+    cli();
+#endif
+    tx_buf_ = (size > 1) ? buffer : NULL;
+    tx_size_ = size;
+    tx_head_ = 0;
+    tx_tail_ = 0;
+#if defined(__AVR__)
+    SREG = sreg;
+#endif
+    tx_from_isr_ = from_interrupt;
+    tx_unsized_ = unsized_bytes;
+}
+
+// callback is called (from serviceTx(), so possibly in an interrupt) each
+// time the queue empties
+void SimpleESP8266::setTxCallback(EspTxCallback callback, void *context)
+{
+    tx_callback_ = callback;
+    tx_context_ = context;
+}
+
+// Bytes queued but not yet handed to the UART
+uint16_t SimpleESP8266::txPending()
+{
+    uint16_t tail = txTail();
+    return (tx_head_ >= tail) ? tx_head_ - tail : tx_size_ - tail + tx_head_;
+}
+
+// Reads tx_tail_, which serviceTx() may be changing in an interrupt
+uint16_t SimpleESP8266::txTail()
+{
+    uint16_t tail;
+#if defined(__AVR__)
+    uint8_t sreg = SREG;
+    cli();
+    tail = tx_tail_;
+    SREG = sreg;
+#else
+    tail = tx_tail_;
+#endif
+    return tail;
+}
+
+// Moves tx_head_, which serviceTx() may be reading in an interrupt
+void SimpleESP8266::setTxHead(uint16_t head)
+{
+#if defined(__AVR__)
+    uint8_t sreg = SREG;
+    cli();
+    tx_head_ = head;
+    SREG = sreg;
+#else
+    tx_head_ = head;
+#endif
+}
+
+// Copy bytes into the queue, waiting for serviceTx() where it's full
+void SimpleESP8266::queueBytes(const uint8_t *buffer, size_t size)
+{
+    while (size > 0)
+    {
+        uint16_t tail = txTail();
+        uint16_t next = tx_head_ + 1 == tx_size_ ? 0 : tx_head_ + 1;
+        if (next == tail)
+        {
+            if (!tx_from_isr_)
+            {
+                serviceTx();
+            }
+            continue;
+        }
+        //Copy as much as fits before the wrap or the tail
+        uint16_t room = (tx_head_ >= tail) ? tx_size_ - tx_head_ - (tail == 0 ? 1 : 0) : tail - tx_head_ - 1;
+        uint16_t n = size < room ? size : room;
+        memcpy(tx_buf_ + tx_head_, buffer, n);
+        buffer += n;
+        size -= n;
+        setTxHead((tx_head_ + n == tx_size_) ? 0 : tx_head_ + n);
+    }
+}
+
+// Hand queued bytes to the stream, as many as it can take without
+// blocking.  Returns true if the queue is now empty.  Safe to call from a
+// timer interrupt when the queue was set up with from_interrupt = true.
+boolean SimpleESP8266::serviceTx()
+{
+    if (!tx_buf_)
+    {
+        return true;
+    }
+    uint16_t head = tx_head_;
+    uint16_t tail = tx_tail_;
+    if (head == tail)
+    {
+        return true;
+    }
+    //A full UART also says 0, and writing to it then would block
+    int room = tx_unsized_ ? tx_unsized_ : stream_->availableForWrite();
+    while (room > 0 && tail != head)
+    {
+        uint16_t n = (head > tail) ? head - tail : tx_size_ - tail;
+        if (n > (uint16_t)room)
+        {
+            n = room;
+        }
+        stream_->write(tx_buf_ + tail, n);
+        room -= n;
+        tail = (tail + n == tx_size_) ? 0 : tail + n;
+        tx_tail_ = tail;
+    }
+    if (tail != head)
+    {
+        return false;
+    }
+    if (tx_callback_)
+    {
+        tx_callback_(tx_context_);
+    }
+    return true;
+}
+
+// Wait until everything queued has been handed to the UART
+void SimpleESP8266::flushTx()
+{
+    while (tx_buf_ && txPending() > 0)
+    {
+        if (!tx_from_isr_)
+        {
+            serviceTx();
+        } else
+        {
+            idle();
+        }
+    }
+}
+
+// Sends a flash-resident string of known length, a block at a time.  Use
+// with ESP_P() so the length of a literal is worked out by the compiler.
+void SimpleESP8266::writeP(const char *str, uint16_t len)
+{
+    uint8_t block[ESP_WRITE_BLOCK];
+    while (len > 0)
+    {
+        uint8_t n = len > sizeof(block) ? sizeof(block) : len;
+        memcpy_P(block, str, n);
+        write(block, n);
+        str += n;
+        len -= n;
+    }
+}
+
+void SimpleESP8266::writeP(EspStr *str)
+{
+    writeP((const char *)str, strlen_P((Pchr *)str));
+}
+
+// Sends a decimal number, optionally followed by CR LF, in a single write
+void SimpleESP8266::writeNumber(uint32_t value, boolean end_line)
+{
+    char buf[10 + 2];
+    char *p = buf + sizeof(buf);
+    if (end_line)
+    {
+        *--p = '\n';
+        *--p = '\r';
+    }
+    do
+    {
+        *--p = '0' + value % 10;
+        value /= 10;
+    } while (value > 0);
+    write((const uint8_t *)p, buf + sizeof(buf) - p);
+}
+
+// Called before the first byte of each command.  The module often falls
+// behind if we transmit too fast, so unless the caller has already waited
+// (see EspTask) sleep for a bit first.
+void SimpleESP8266::startTransmission(boolean pace)
+{
+    if (pace)
+    {
+        delay(ESP_TX_PACE);
+    }
+    writing_ = true;
+    if (debug_)
+    {
+        debug_->print(DEBUG_STR("\r\n"));
+        debug_->print(indent_);
+        debug_->print(DEBUG_STR("-S->"));
+    }
+}
+
 void SimpleESP8266::clearStreamBuffer()
 {
-    delay(250);
+    pause(250);
     while (stream_->available())
     {
         (void)stream_->read();
@@ -133,6 +402,118 @@ void SimpleESP8266::setDebug(Stream *debug)
     debug_ = debug;
 }
 
+// Choose what blocking calls do between polls of the module (see EspIdle.h).
+// ESP_IDLE_SLEEP cuts power while waiting for clients; ESP_IDLE_CALLBACK
+// lets other work run, but the callback must not use this object.
+void SimpleESP8266::setIdleStrategy(uint8_t strategy, EspIdleCallback callback, void *context)
+{
+    idle_strategy_ = strategy;
+    idle_callback_ = callback;
+    idle_context_ = context;
+}
+
+void SimpleESP8266::idle()
+{
+    if (tx_buf_ && !tx_from_isr_ && !serviceTx())
+    {
+        return;  //Still sending, so don't sleep
+    }
+    espIdle(idle_strategy_, idle_callback_, idle_context_);
+}
+
+// delay() that runs the idle strategy while it waits.  Cut short by the
+// operation's deadline.
+void SimpleESP8266::pause(uint32_t ms)
+{
+    uint32_t t0 = millis();
+    ms = boundedTimeout(ms);
+    while ((millis() - t0) < ms)
+    {
+        idle();
+    }
+}
+
+// Give the next public operation an absolute deadline (a future millis()
+// value).  It returns false, with lastResult() == ESP_RESULT_DEADLINE, if it
+// can't finish in time, however the module behaves.
+void SimpleESP8266::setDeadline(uint32_t deadline)
+{
+    deadline_ = deadline;
+    deadline_set_ = true;
+}
+
+// Operations without an explicit deadline must finish within their own
+// timeouts (e.g. the AP connect timeout for connectToAP, the data timeout
+// for tcpRecv) plus this many milliseconds.  0 removes the limit, so only
+// the idle timeouts between bytes apply.
+void SimpleESP8266::setCommandBudget(uint32_t budget)
+{
+    command_budget_ = budget;
+}
+
+// How the last public operation ended
+EspResult SimpleESP8266::lastResult()
+{
+    return last_result_;
+}
+
+SimpleESP8266::Operation::Operation(SimpleESP8266 *esp, uint32_t timeout) :
+    esp_(esp)
+{
+    if (esp_->op_depth_++ > 0)
+    {
+        return;
+    }
+    esp_->last_result_ = ESP_RESULT_OK;
+    if (esp_->deadline_set_)
+    {
+        esp_->deadline_set_ = false;
+        esp_->deadline_active_ = true;
+    } else if (esp_->command_budget_)
+    {
+        esp_->deadline_ = millis() + timeout + esp_->command_budget_;
+        esp_->deadline_active_ = true;
+    }
+}
+
+SimpleESP8266::Operation::~Operation()
+{
+    if (--esp_->op_depth_ == 0)
+    {
+        esp_->deadline_active_ = false;
+    }
+}
+
+// Returns true (and records it as the result) once the current operation's
+// deadline has passed.
+boolean SimpleESP8266::deadlinePassed()
+{
+    if (deadline_active_ && (int32_t)(millis() - deadline_) >= 0)
+    {
+        last_result_ = ESP_RESULT_DEADLINE;
+        return true;
+    }
+    return false;
+}
+
+// timeout, shortened if the operation's deadline comes sooner
+uint32_t SimpleESP8266::boundedTimeout(uint32_t timeout)
+{
+    if (deadline_active_)
+    {
+        int32_t remaining = deadline_ - millis();
+        if (remaining <= 0)
+        {
+            return 0;
+        }
+        if ((uint32_t)remaining < timeout)
+        {
+            return remaining;
+        }
+    }
+    return timeout;
+}
+
 // Equivalent to Arduino Stream find() function, but with search string in
 // flash/PROGMEM rather than RAM-resident.  Returns true if string found
 // (any further pending input remains in stream_), false if timeout occurs.
@@ -144,6 +525,7 @@ void SimpleESP8266::setDebug(Stream *debug)
 #define FIND_BUFFER_SIZE 8
 boolean SimpleESP8266::find(EspStr *search_str, boolean ipd, boolean verbose)
 {
+    Operation op(this, receive_timeout_);
     uint8_t  stringLength, matchedLength = 0;
     int      c;
     boolean  found = false;
@@ -151,6 +533,7 @@ boolean SimpleESP8266::find(EspStr *search_str, boolean ipd, boolean verbose)
     uint16_t bytesAvailable;
     uint16_t bytesRead;
     boolean timedOut = false;
+    boolean deadline = false;
     boolean ipd_fail = false;
     char buffer[FIND_BUFFER_SIZE + 1]; //+1 to allow for nullchar
 
@@ -194,17 +577,9 @@ boolean SimpleESP8266::find(EspStr *search_str, boolean ipd, boolean verbose)
         {
             debug_->println();
         }
-        if (find(F("+IPD,")))
+        if (!find(F("+IPD,")) || !parseIpdHeader())
         {
-            //The device formats the message like this:
-            //  +IPD,#,DATALEN:DATA
-            //  Where # is normally 0.
-            //Scan until we get a : symbol (end of IPD, start of data)
-            boolean result = find(F(":"));
-            if (!result)
-            {
-                return result;
-            }
+            return false;
         }
     }
     tLastGoodData = millis();
@@ -220,6 +595,13 @@ boolean SimpleESP8266::find(EspStr *search_str, boolean ipd, boolean verbose)
             break;
         }
 
+        //Data still arriving doesn't extend the deadline, so check it first
+        if (deadlinePassed())
+        {
+            deadline = true;
+            break;
+        }
+
         // Check for new data
         bytesAvailable = stream_->available();
         if (bytesAvailable > 0)
@@ -257,6 +639,7 @@ boolean SimpleESP8266::find(EspStr *search_str, boolean ipd, boolean verbose)
             for (uint8_t buffer_index = 0; buffer_index < bytesAvailable; ++buffer_index)
             {
                 c = buffer[buffer_index];
+                scanLinkEvent(c);
                 // Match next byte?
                 if (c == pgm_read_byte((Pchr *)search_str +
                                        matchedLength))
@@ -283,11 +666,20 @@ boolean SimpleESP8266::find(EspStr *search_str, boolean ipd, boolean verbose)
             if ((millis() - tLastGoodData) > receive_timeout_)
             {
                 timedOut = true;
+                last_result_ = ESP_RESULT_IDLE_TIMEOUT;
                 break;
             }
+            idle();
         }
     }
 
+    if (ipd && stringLength > 0)
+    {
+        //The search ran through the data without counting it (and with
+        //ipd_remaining_ still set, without looking for link events in it)
+        ipd_remaining_ = 0;
+    }
+
     if (debug_)
     {
         if (found)
@@ -296,6 +688,9 @@ boolean SimpleESP8266::find(EspStr *search_str, boolean ipd, boolean verbose)
         } else if (timedOut)
         {
             debug_->println(DEBUG_STR("not found (timeout)"));
+        } else if (deadline)
+        {
+            debug_->println(DEBUG_STR("not found (deadline)"));
         } else if (ipd_fail) {
             //don't print anything, it was already done
         } else
@@ -307,18 +702,207 @@ boolean SimpleESP8266::find(EspStr *search_str, boolean ipd, boolean verbose)
     return found;
 }
 
+// Parse the rest of an "+IPD,[<id>,]<len>[,<remote IP>,<remote port>]:"
+// header (the "+IPD," has already been consumed), leaving the stream at the
+// start of the data.  Records which link the data arrived on and how many
+// data bytes follow.  Returns false if the header was malformed or timed out.
+boolean SimpleESP8266::parseIpdHeader()
+{
+    int32_t value;
+    int c = parseNumber(&value, receive_timeout_);
+    //The link ID is only present in multiple connection mode
+    if (mux_ && c == ',')
+    {
+        ipd_link_ = value;
+        c = parseNumber(&value, receive_timeout_);
+    } else
+    {
+        ipd_link_ = 0;
+    }
+    ipd_remaining_ = value;
+    //AT+CIPDINFO=1 adds the remote IP and port
+    ipd_remote_ip_ = 0;
+    ipd_remote_port_ = 0;
+    if (c == ',')
+    {
+        c = parseIp(&ipd_remote_ip_, receive_timeout_);
+        if (c == ',')
+        {
+            c = parseNumber(&value, receive_timeout_);
+            ipd_remote_port_ = value;
+        }
+    }
+    while (c >= 0 && c != ':')
+    {
+        c = readByte(receive_timeout_);
+    }
+    linkReceived(ipd_link_);
+    if (debug_)
+    {
+        debug_->print(indent_);
+        debug_->print(DEBUG_STR("IPD link "));
+        debug_->print(ipd_link_);
+        debug_->print(DEBUG_STR(" len "));
+        debug_->println(ipd_remaining_);
+    }
+    return c == ':';
+}
+
+// Like find(), but gives up as soon as either string is seen so that failures
+// (e.g. "ERROR" or "SEND FAIL") don't have to wait out the timeout.  Passing
+// NULL for success looks for "OK".  Returns 1 if success was found, 0 if
+// failure was found, or -1 on timeout.
+int8_t SimpleESP8266::findEither(EspStr *success, EspStr *failure)
+{
+    Operation op(this, receive_timeout_);
+    EspMatch  match;
+    EspStatus status;
+
+    beginMatch(&match, success, failure, receive_timeout_);
+    for (;;)
+    {
+        status = stepMatch(&match, 0xFFFF);
+        if (status != ESP_PENDING)
+        {
+            break;
+        }
+        idle();
+    }
+
+    if (status == ESP_DONE)
+    {
+        return 1;
+    }
+    if (!match.timed_out)
+    {
+        last_result_ = ESP_RESULT_ERROR;
+    }
+    if (debug_)
+    {
+        debug_->print(indent_);
+        if (match.timed_out)
+        {
+            debug_->println(DEBUG_STR("not found (timeout)"));
+        } else
+        {
+            debug_->print(DEBUG_STR("failed: "));
+            debug_->println(failure);
+        }
+    }
+    return match.timed_out ? -1 : 0;
+}
+
+// Start a non-blocking search for success (or failure, which may be NULL) in
+// the module's output.  Passing NULL for success looks for "OK".  timeout is
+// the longest gap allowed between bytes.
+void SimpleESP8266::beginMatch(EspMatch *match, EspStr *success, EspStr *failure, uint32_t timeout)
+{
+    if (success == NULL)
+    {
+        success = F("OK\r\n");
+    }
+    if (debug_ && writing_)
+    {
+        debug_->println(DEBUG_STR("<-S-"));
+    }
+    writing_ = false;
+    match->success = success;
+    match->failure = failure;
+    match->success_matched = 0;
+    match->failure_matched = 0;
+    match->timed_out = false;
+    match->timeout = timeout;
+    match->t_last = millis();
+}
+
+// Advance str's match count by one received character.  Returns true once
+// the whole string has been matched.
+static boolean matchByte(int c, EspStr *str, uint8_t *matched)
+{
+    if (c == pgm_read_byte((Pchr *)str + *matched))
+    {
+        (*matched)++;
+        return pgm_read_byte((Pchr *)str + *matched) == '\0';
+    }
+    // Character mismatch; it may still start a new match
+    *matched = (c == pgm_read_byte((Pchr *)str)) ? 1 : 0;
+    return false;
+}
+
+// Consume at most max_bytes of whatever input is already waiting, without
+// blocking.  Returns ESP_DONE once success is matched, ESP_ERROR once
+// failure is matched or the timeout expires, and ESP_PENDING otherwise.
+EspStatus SimpleESP8266::stepMatch(EspMatch *match, uint16_t max_bytes)
+{
+    int     c;
+    boolean data;
+    if (pgm_read_byte((Pchr *)match->success) == '\0')
+    {
+        return ESP_DONE;
+    }
+    while (max_bytes > 0 && stream_->available())
+    {
+        max_bytes--;
+        c = stream_->read();
+        match->t_last = millis();
+        //The data of a +IPD frame that arrived meanwhile isn't part of the
+        //  reply, so e.g. a '>' in it can't pass for CIPSEND's prompt
+        data = (event_state_ == EVENT_IPD_DATA);
+        scanLinkEvent(c);
+        if (data)
+        {
+            continue;
+        }
+        if (matchByte(c, match->success, &match->success_matched))
+        {
+            return ESP_DONE;
+        }
+        if (match->failure && matchByte(c, match->failure, &match->failure_matched))
+        {
+            return ESP_ERROR;
+        }
+    }
+    if (deadlinePassed())
+    {
+        match->timed_out = true;
+        return ESP_ERROR;
+    }
+    if (!stream_->available() && (millis() - match->t_last) > match->timeout)
+    {
+        match->timed_out = true;
+        last_result_ = ESP_RESULT_IDLE_TIMEOUT;
+        return ESP_ERROR;
+    }
+    return ESP_PENDING;
+}
+
 void SimpleESP8266::setupUART(uint32_t baud, uint8_t data_bits, uint8_t stop_bits, uint8_t parity, uint8_t flow_control)
 {
-    stream_->print(F("AT+UART_CUR="));
-    stream_->print(baud);
-    stream_->print(F(","));
-    stream_->print(data_bits);
-    stream_->print(F(","));
-    stream_->print(stop_bits);
-    stream_->print(F(","));
-    stream_->print(parity);
-    stream_->print(F(","));
-    stream_->println(flow_control);
+    flushTx();
+    if (!hasCap(ESP_CAP_UART_CUR))
+    {
+        //Older firmware can only change the baud rate
+        stream_->print(F("AT+CIOBAUD="));
+        stream_->println(baud);
+    } else
+    {
+        stream_->print(F("AT+UART_CUR="));
+        stream_->print(baud);
+        stream_->print(F(","));
+        stream_->print(data_bits);
+        stream_->print(F(","));
+        stream_->print(stop_bits);
+        stream_->print(F(","));
+        stream_->print(parity);
+        stream_->print(F(","));
+        stream_->println(flow_control);
+    }
+    if (baud_callback_)
+    {
+        stream_->flush();       // Let the command out at the old rate
+        delay(ESP_TX_PACE);     // and the module answer before it switches
+        baud_callback_(baud, baud_context_);
+    }
 
     //Note that since this command changes the baud rate it doesn't really make sense to flush the buffer. So, the user should call clearStreamBuffer() after adjusting their own serial port
 }
@@ -327,7 +911,9 @@ void SimpleESP8266::setupUART(uint32_t baud, uint8_t data_bits, uint8_t stop_bit
 // chars read is 1 less than this, so NUL can be appended on string.
 int SimpleESP8266::readLine(char *buf, int buf_size)
 {
+    Operation op(this, receive_timeout_);
     int bytesRead = 1;
+    uint32_t t0;
     if (debug_ && writing_)
     {
         debug_->println(DEBUG_STR("<-S-"));
@@ -337,7 +923,22 @@ int SimpleESP8266::readLine(char *buf, int buf_size)
     //Ignore blank lines
     while (bytesRead <= 2 && (buf[0] == '\r' || buf[0] == '\n' || buf[0] == '\0'))
     {
+        if (deadlinePassed())
+        {
+            bytesRead = 0;
+            break;
+        }
+        flushTx();
+        t0 = millis();
+        stream_->setTimeout(boundedTimeout(receive_timeout_));
         bytesRead = stream_->readBytesUntil('\n', buf, buf_size - 1);
+        stream_->setTimeout(receive_timeout_);
+        if (bytesRead == 0 && (millis() - t0) >= receive_timeout_)
+        {
+            //Nothing at all arrived
+            last_result_ = ESP_RESULT_IDLE_TIMEOUT;
+            break;
+        }
     }
     buf[bytesRead] = 0;
     if (debug_)
@@ -377,6 +978,241 @@ void SimpleESP8266::escapedDebugPrint(char* str)
     }
 }
 
+// Read a single byte from the module, waiting up to timeout milliseconds for
+// it to arrive.  Returns the byte, or -1 on timeout.
+int SimpleESP8266::readByte(uint32_t timeout)
+{
+    uint32_t t0 = millis();
+    int      c;
+    if (deadlinePassed())
+    {
+        return -1;
+    }
+    while (!stream_->available())
+    {
+        if (deadlinePassed())
+        {
+            return -1;
+        }
+        if ((millis() - t0) > timeout)
+        {
+            last_result_ = ESP_RESULT_IDLE_TIMEOUT;
+            return -1;
+        }
+        idle();
+    }
+    c = stream_->read();
+    scanLinkEvent(c);
+    return c;
+}
+
+// Discard input through the end of the current line.  Returns '\n', or -1 on
+// timeout.
+int SimpleESP8266::skipLine(uint32_t timeout)
+{
+    int c;
+    do
+    {
+        c = readByte(timeout);
+    } while (c >= 0 && c != '\n');
+    return c;
+}
+
+// The parse functions below decode one comma-separated field of a module
+// response straight from the stream, without buffering the line.  Each
+// returns the character that ended the field (normally ',' or ')' or '\r'),
+// or -1 on timeout.
+
+// Parse an optionally negative decimal number.
+int SimpleESP8266::parseNumber(int32_t *value, uint32_t timeout)
+{
+    boolean negative = false;
+    int32_t result = 0;
+    int c = readByte(timeout);
+    if (c == '-')
+    {
+        negative = true;
+        c = readByte(timeout);
+    }
+    while (c >= '0' && c <= '9')
+    {
+        result = result * 10 + (c - '0');
+        c = readByte(timeout);
+    }
+    *value = negative ? -result : result;
+    return c;
+}
+
+// Parse a double-quoted string into buf (pass NULL to discard it), truncating
+// to buf_size - 1 characters.  If the field isn't quoted the unexpected
+// character is returned.
+int SimpleESP8266::parseQuoted(char *buf, uint8_t buf_size, uint32_t timeout)
+{
+    uint8_t len = 0;
+    int c = readByte(timeout);
+    if (c != '"')
+    {
+        return c;
+    }
+    for (;;)
+    {
+        c = readByte(timeout);
+        if (c < 0)
+        {
+            return c;
+        }
+        if (c == '"')
+        {
+            break;
+        }
+        if (buf && len < buf_size - 1)
+        {
+            buf[len++] = c;
+        }
+    }
+    if (buf)
+    {
+        buf[len] = '\0';
+    }
+    return readByte(timeout);
+}
+
+// Parse a "aa:bb:cc:dd:ee:ff" MAC address, quoted or not, into 6 bytes.
+int SimpleESP8266::parseMac(uint8_t *mac, uint32_t timeout)
+{
+    boolean quoted = false;
+    uint8_t index = 0;
+    int c = readByte(timeout);
+    if (c == '"')
+    {
+        quoted = true;
+        c = readByte(timeout);
+    }
+    memset(mac, 0, 6);
+    for (;;)
+    {
+        uint8_t nibble;
+        if (c >= '0' && c <= '9')
+        {
+            nibble = c - '0';
+        } else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f')
+        {
+            nibble = (c | 0x20) - 'a' + 10;
+        } else if (c == ':')
+        {
+            index++;
+            c = readByte(timeout);
+            continue;
+        } else
+        {
+            break;
+        }
+        if (index < 6)
+        {
+            mac[index] = (mac[index] << 4) | nibble;
+        }
+        c = readByte(timeout);
+    }
+    if (quoted && c == '"')
+    {
+        c = readByte(timeout);
+    }
+    return c;
+}
+
+// Parse a dotted IPv4 address, quoted or not (see ESP_IP()).
+int SimpleESP8266::parseIp(uint32_t *ip, uint32_t timeout)
+{
+    boolean  quoted = false;
+    uint32_t result = 0;
+    uint16_t octet = 0;
+    int c = readByte(timeout);
+    if (c == '"')
+    {
+        quoted = true;
+        c = readByte(timeout);
+    }
+    for (;;)
+    {
+        if (c >= '0' && c <= '9')
+        {
+            octet = octet * 10 + (c - '0');
+        } else if (c == '.')
+        {
+            result = (result << 8) | (octet & 0xFF);
+            octet = 0;
+        } else
+        {
+            break;
+        }
+        c = readByte(timeout);
+    }
+    *ip = (result << 8) | (octet & 0xFF);
+    if (quoted && c == '"')
+    {
+        c = readByte(timeout);
+    }
+    return c;
+}
+
+// Dotted IPv4 address already read into RAM (see ESP_IP())
+static uint32_t ipFromText(const char *text)
+{
+    uint32_t ip = 0;
+    uint16_t octet = 0;
+    for (; *text; ++text)
+    {
+        if (*text == '.')
+        {
+            ip = (ip << 8) | (octet & 0xFF);
+            octet = 0;
+        } else
+        {
+            octet = octet * 10 + (*text - '0');
+        }
+    }
+    return (ip << 8) | (octet & 0xFF);
+}
+
+// Read the tag at the start of a response line ("+CIFSR", "STATUS", "OK"...)
+// into tag, skipping blank lines.  The tag ends at ':', ',' or '\r', which
+// is returned.
+int SimpleESP8266::parseTag(char *tag, uint8_t tag_size, uint32_t timeout)
+{
+    uint8_t len = 0;
+    int c;
+    do
+    {
+        c = readByte(timeout);
+    } while (c == '\r' || c == '\n');
+    while (c >= 0 && c != ':' && c != ',' && c != '\r' && c != '\n')
+    {
+        if (len < tag_size - 1)
+        {
+            tag[len++] = c;
+        }
+        c = readByte(timeout);
+    }
+    tag[len] = '\0';
+    return c;
+}
+
+// Returns 1 if tag is the final line of a successful response, 0 if it ends
+// a failed one, else -1
+int8_t SimpleESP8266::responseEnd(const char *tag)
+{
+    if (strcmp_P(tag, PSTR("OK")) == 0)
+    {
+        return 1;
+    }
+    if (strcmp_P(tag, PSTR("ERROR")) == 0 || strcmp_P(tag, PSTR("FAIL")) == 0)
+    {
+        last_result_ = ESP_RESULT_ERROR;
+        return 0;
+    }
+    return -1;
+}
+
 // ESP8266 is reset by momentarily connecting RST to GND.  Level shifting is
 // not necessary provided you don't accidentally set the pin to HIGH output.
 // It's generally safe-ish as the default Arduino pin state is INPUT (w/no
@@ -385,6 +1221,7 @@ void SimpleESP8266::escapedDebugPrint(char* str)
 // false otherwise.
 boolean SimpleESP8266::hardReset(void)
 {
+    Operation op(this, reset_timeout_);
     boolean found;
     if (reset_pin_ < 0)
     {
@@ -403,22 +1240,23 @@ boolean SimpleESP8266::hardReset(void)
 // Soft reset.  Returns true if expected boot message received, else false.
 boolean SimpleESP8266::softReset(void)
 {
+    Operation op(this, reset_timeout_ + 1000);
     boolean  found = false;
     uint32_t save = receive_timeout_; // Temporarily override recveive timeout,
     setTimeouts(reset_timeout_);    // reset time is longer than normal I/O.
-    this->println(F("AT+RST"));            // Issue soft-reset command
+    writeP(ESP_P("AT+RST\r\n"));            // Issue soft-reset command
     // Wait for boot message
     if (find((EspStr*)defaultBootMarker))
     {
         //Wait for any other post-boot messages
-        delay(1000);
+        pause(1000);
         clearStreamBuffer();
         if (debug_)
         {
             debug_->print(indent_);
             debug_->print(DEBUG_STR("Echo off"));
         }
-        this->println(F("ATE0"));            // Turn off echo
+        writeP(ESP_P("ATE0\r\n"));            // Turn off echo
         found = find();                // OK?
     }
     setTimeouts(save);   // Restore normal receive timeout
@@ -437,38 +1275,128 @@ void SimpleESP8266::debugLoop(void)
     }
 
     debug_->println(DEBUG_STR("\n="));
-    for (;;)
+    bridge();
+}
+
+// Pass data between the debug stream and the module in blocks, e.g. so a
+// host tool can talk to the AT firmware or reflash it.
+//  baud      -- if non-zero, first switch to this rate.  The AT firmware is
+//               told with setupUART(); in bootloader mode (which detects the
+//               rate itself) only the baud callback is called.  Either way
+//               the sketch's callback must change the serial ports.
+//  gpio0_pin -- if given, hold the module's GPIO0 low across a hard reset so
+//               it starts its serial bootloader instead of the firmware.
+//               Needs the reset pin.  Call hardReset() afterwards to run the
+//               new firmware.
+//  quiet_ms  -- return after this long with no traffic (0 = never return).
+// Returns false if there's no debug stream or the bootloader can't be
+// entered.  Counts go to bridgeStats().
+boolean SimpleESP8266::bridge(uint32_t baud, int8_t gpio0_pin, uint32_t quiet_ms)
+{
+    uint8_t  block[ESP_BRIDGE_BLOCK];
+    uint32_t t_last;
+
+    if (!debug_)
+    {
+        return false;
+    }
+    flushTx();
+    memset(&bridge_stats_, 0, sizeof(bridge_stats_));
+    if (gpio0_pin >= 0)
     {
-        if (debug_->available())
+        if (reset_pin_ < 0)
+        {
+            return false;
+        }
+        digitalWrite(gpio0_pin, LOW);
+        pinMode(gpio0_pin, OUTPUT);      // Open drain, like the reset pin
+        digitalWrite(reset_pin_, LOW);
+        pinMode(reset_pin_, OUTPUT);
+        delay(10);
+        pinMode(reset_pin_, INPUT);     // Boot mode is sampled as it comes out of reset
+        delay(100);
+        pinMode(gpio0_pin, INPUT);
+        if (baud && baud_callback_)
         {
-            stream_->write(debug_->read());
+            baud_callback_(baud, baud_context_);
         }
-        if (stream_->available())
+    } else if (baud)
+    {
+        setupUART(baud);
+    }
+    clearStreamBuffer();
+
+    t_last = millis();
+    for (;;)
+    {
+        //Host -> module first: the bootloader only talks when spoken to
+        uint8_t to_module = bridgeBlock(debug_, stream_, block);
+        uint8_t to_host = bridgeBlock(stream_, debug_, block);
+        bridge_stats_.to_module += to_module;
+        bridge_stats_.to_host += to_host;
+        if (to_module || to_host)
+        {
+            t_last = millis();
+        } else if (quiet_ms && (millis() - t_last) >= quiet_ms)
         {
-            debug_->write(stream_->read());
+            return true;
         }
     }
 }
 
+// Copy up to a block of waiting bytes from one stream to the other.  Returns
+// the number copied.
+uint8_t SimpleESP8266::bridgeBlock(Stream *from, Stream *to, uint8_t *block)
+{
+    int n = from->available();
+    if (n <= 0)
+    {
+        return 0;
+    }
+    if (n >= ESP_BRIDGE_RX_FULL)
+    {
+        bridge_stats_.overruns++;
+    }
+    if (n > ESP_BRIDGE_BLOCK)
+    {
+        n = ESP_BRIDGE_BLOCK;
+    }
+    n = from->readBytes((char *)block, n);
+    to->write(block, n);
+    return n;
+}
+
+const EspBridgeStats *SimpleESP8266::bridgeStats()
+{
+    return &bridge_stats_;
+}
+
+// callback is called with the new rate whenever setupUART() or bridge()
+// changes the module's baud rate, so the sketch can begin() its own serial
+// port at the same rate
+void SimpleESP8266::setBaudCallback(EspBaudCallback callback, void *context)
+{
+    baud_callback_ = callback;
+    baud_context_ = context;
+}
+
 // Connect to WiFi access point.  SSID and password are flash-resident
 // strings.  May take several seconds to execute, this is normal.
+// Optionally pass the 6-byte MAC of a specific AP (e.g. from findStrongestAP)
+// so the module associates with it directly.
 // Returns true on successful connection, false otherwise.
-boolean SimpleESP8266::connectToAP(EspStr *ssid, EspStr *pass)
+boolean SimpleESP8266::connectToAP(EspStr *ssid, EspStr *pass, const uint8_t *bssid)
 {
+    Operation op(this, connect_timeout_);
     clearStreamBuffer();
-    this->println(F("AT+CWMODE=1")); // WiFi mode = Sta
-    if (!find())
+    if (!setStationMode())
     {
         return false;
     }
-    this->print(F("AT+CWJAP=\"")); // Join access point
-    this->print(ssid);
-    this->print(F("\",\""));
-    this->print(pass);
-    this->println(F("\""));
+    writeJoinAP(ssid, pass, bssid);
     uint32_t save = receive_timeout_;  // Temporarily override recv timeout,
     setTimeouts(connect_timeout_); // connection time is much longer!
-    boolean found = find();          // Await 'OK' message
+    boolean found = (findEither(NULL, F("FAIL")) == 1); // Await 'OK' message
     setTimeouts(save);           // Restore normal receive timeout
     if (found)
     {
@@ -477,8 +1405,10 @@ boolean SimpleESP8266::connectToAP(EspStr *ssid, EspStr *pass)
             debug_->print(indent_);
             debug_->println(DEBUG_STR("Associated with AP"));
         }
-        this->println(F("AT+CIPMUX=0"));     // Set single-client mode
+        writeP(ESP_P("AT+CIPMUX=0\r\n"));     // Set single-client mode
         found = find();                // Await 'OK'
+        mux_ = false;
+        links_open_ = 0;
         if (debug_)
         {
             debug_->print(indent_);
@@ -488,156 +1418,1384 @@ boolean SimpleESP8266::connectToAP(EspStr *ssid, EspStr *pass)
     return found;
 }
 
-void SimpleESP8266::closeAP(void)
-{
-    this->println(F("AT+CWQAP")); // Quit access point
-    find(); // Purge 'OK'
-}
-
-// Open TCP connection to an already-listening host.  Hostname is flash-resident string.
-// Returns true on successful connection, else false.
-boolean SimpleESP8266::connectTCP(EspStr *hostname, int port)
+// Send the AT+CWJAP command for connectToAP() (and EspConnectAPTask)
+void SimpleESP8266::writeJoinAP(EspStr *ssid, EspStr *pass, const uint8_t *bssid)
 {
-
-    this->print(F("AT+CIPSTART=\"TCP\",\""));
-    this->print(hostname);
-    this->print(F("\","));
-    this->println(port);
-
-    if (find())
+    if (!persist_ap_ && hasCap(ESP_CAP_CUR_DEF))
     {
-        host_ = hostname;
-        return true;
+        writeP(ESP_P("AT+CWJAP_CUR=\"")); // Join access point without saving it
+    } else
+    {
+        writeP(ESP_P("AT+CWJAP=\"")); // Join access point
     }
-    return false;
-}
-
-// Accept TCP connection.
-// Returns true on successful setup, else false.
-boolean SimpleESP8266::acceptTCP(uint16_t port)
-{
-    this->println(F("AT+CIPMODE=0"));
-    if (!find())
+    writeP(ssid);
+    writeP(ESP_P("\",\""));
+    if (pass) // NULL for an open network
     {
-        return false;
+        writeP(pass);
     }
-    this->println(F("AT+CIPMUX=1"));
-    if (!find())
+    if (bssid)
     {
-        return false;
+        //Format as "\",\"xx:xx:xx:xx:xx:xx" and send it in one go
+        static const char hex[] PROGMEM = "0123456789abcdef";
+        char mac[3 + 6 * 3 - 1];
+        char *p = mac;
+        *p++ = '"';
+        *p++ = ',';
+        *p++ = '"';
+        for (uint8_t i = 0; i < 6; ++i)
+        {
+            if (i > 0)
+            {
+                *p++ = ':';
+            }
+            *p++ = pgm_read_byte(hex + (bssid[i] >> 4));
+            *p++ = pgm_read_byte(hex + (bssid[i] & 0x0F));
+        }
+        write((const uint8_t *)mac, sizeof(mac));
     }
+    writeP(ESP_P("\"\r\n"));
+}
 
-    this->print(F("AT+CIPSERVER=1,"));
-    this->println(port);
+// Scan for access points.  Each "+CWLAP:(ecn,"ssid",rssi,"mac",ch,...)" line
+// is decoded as it arrives and handed to callback, so the whole list (which
+// can be several KB) never has to fit in RAM.  Passing an ssid limits the
+// scan to that network; APs weaker than min_rssi are skipped.
+// Returns the number of APs passed to callback, or -1 on error/timeout.
+int16_t SimpleESP8266::scanAPs(EspApCallback callback, void *context, EspStr *ssid, int8_t min_rssi)
+{
+    Operation op(this, connect_timeout_);
+    EspApInfo ap;
+    int16_t   count = 0;
+    int32_t   value;
+    int       c;
+    boolean   valid;
 
-    if (!find())
+    clearStreamBuffer();
+    if (!setStationMode()) // Scanning requires station mode
     {
-        return false;
+        return -1;
     }
-    this->print(F("AT+CIPSTO="));
-    this->println(client_timeout_ / 1000);
-    if (!find())
+    if (ssid)
     {
-        return false;
+        writeP(ESP_P("AT+CWLAP=\""));
+        writeP(ssid);
+        writeP(ESP_P("\"\r\n"));
+    } else
+    {
+        writeP(ESP_P("AT+CWLAP\r\n"));
+    }
+    if (debug_ && writing_)
+    {
+        debug_->println(DEBUG_STR("<-S-"));
     }
+    writing_ = false;
 
-    return true;
-}
-int32_t SimpleESP8266::tcpRecv(char *buffer, uint32_t buffer_len)
-{
-    uint32_t buffer_pos = 0; //index of the next character to write to
-    int32_t bytes_available;
-    //Check here first for bytes available, and return if they are not
-    uint32_t t0 = millis();
-    while (!stream_->available())
+    for (;;)
     {
-        if (millis() - t0 > data_timeout_)
+        //The scan itself takes a few seconds, so allow the AP connect timeout
+        //  for the start of each line
+        c = readByte(connect_timeout_);
+        if (c < 0)
         {
+            if (debug_) debug_->println(DEBUG_STR("Scan timed out"));
             return -1;
         }
-    }
-    //Wait for connection
-    if (!find(F(""), true))
-    {
-        return -1;
-    }
-    //Dequeue all pending data to the buffer
-    bytes_available = stream_->available();
-    if (bytes_available == 0)
-    {
-        //The data may have just not arrived yet, so sleep a bit and check again
-        //At a baud rate of 115200 there is 0.0694 milliseconds between
-        //  characters, and even at 9600 baud there is 0.8 milliseconds,
-        //  so sleeping for 1 millisecond should be plenty long enough.
-        delay(1);
-        bytes_available = stream_->available();
-    }
-    while (bytes_available > 0 && buffer_pos < buffer_len)
-    {
-        if (bytes_available > buffer_len - buffer_pos)
+        if (c == '\r' || c == '\n')
         {
-            bytes_available = buffer_len - buffer_pos;
+            continue;
         }
-        buffer_pos += stream_->readBytes(buffer + buffer_pos, bytes_available);
-        bytes_available = stream_->available();
-        if (bytes_available == 0)
+        if (c == 'O' || c == 'E')
         {
-            //The data may have just not arrived yet, so sleep a bit and check again
-            //See note above on delay durcation
-            delay(1);
-            bytes_available = stream_->available();
+            //"OK" ends the list, "ERROR" means the scan failed
+            if (skipLine(receive_timeout_) < 0 || c == 'E')
+            {
+                return -1;
+            }
+            break;
+        }
+        if (c != '+')
+        {
+            //Not an AP entry (e.g. "busy p...")
+            if (skipLine(receive_timeout_) < 0)
+            {
+                return -1;
+            }
+            continue;
+        }
+        //Skip over "CWLAP:(" to the first field
+        do
+        {
+            c = readByte(receive_timeout_);
+        } while (c >= 0 && c != '(' && c != '\n');
+        if (c < 0)
+        {
+            return -1;
+        }
+        if (c == '\n')
+        {
+            continue;
+        }
+
+        valid = false;
+        c = parseNumber(&value, receive_timeout_);
+        ap.ecn = value;
+        if (c == ',')
+        {
+            c = parseQuoted(ap.ssid, sizeof(ap.ssid), receive_timeout_);
+        }
+        if (c == ',')
+        {
+            c = parseNumber(&value, receive_timeout_);
+            ap.rssi = value;
+        }
+        if (c == ',')
+        {
+            c = parseMac(ap.mac, receive_timeout_);
+        }
+        if (c == ',')
+        {
+            c = parseNumber(&value, receive_timeout_);
+            ap.channel = value;
+            valid = (c == ',' || c == ')');
+        }
+        //Discard the rest of the line (newer firmware appends more fields)
+        if (c != '\n')
+        {
+            c = skipLine(receive_timeout_);
+        }
+        if (c < 0)
+        {
+            return -1;
+        }
+        if (!valid || ap.rssi < min_rssi)
+        {
+            continue;
+        }
+        if (ssid && strcmp_P(ap.ssid, (Pchr *)ssid) != 0)
+        {
+            continue;
+        }
+        if (debug_)
+        {
+            debug_->print(indent_);
+            debug_->print(DEBUG_STR("AP: "));
+            debug_->print(ap.ssid);
+            debug_->print(DEBUG_STR(" ch "));
+            debug_->print(ap.channel);
+            debug_->print(DEBUG_STR(" rssi "));
+            debug_->println(ap.rssi);
+        }
+        count++;
+        if (callback)
+        {
+            callback(&ap, context);
         }
     }
-    //If there's room in the buffer, set the next character to null for good measure
-    if (buffer_pos < buffer_len)
-    {
-        buffer[buffer_pos] = '\0';
-    }
-    return buffer_pos;
+    return count;
 }
 
-
-// Close previously accepted TCP stream
-// Returns true on successful unaccept, else false.
-boolean SimpleESP8266::unacceptTCP()
+static void keepStrongestAP(const EspApInfo *ap, void *context)
 {
-
-    this->println(F("AT+CIPSERVER=0"));
-
-    if (find())
+    EspApInfo *best = (EspApInfo *)context;
+    if (ap->rssi > best->rssi)
     {
-        //The device responds "OK" and then closes the current connections, so discard any additional input that comes
-        clearStreamBuffer();
-        return true;
+        *best = *ap;
     }
-    return false;
 }
 
-void SimpleESP8266::closeTCP(void)
+// Scan and keep the AP with the best signal.  Its mac and channel can then be
+// given to connectToAP so association doesn't have to search for it.
+// Returns true if any AP matched.
+boolean SimpleESP8266::findStrongestAP(EspApInfo *best, EspStr *ssid, int8_t min_rssi)
 {
-    this->println(F("AT+CIPCLOSE"));
-    find(F("Unlink\r\n"));
+    best->rssi = -128;
+    best->ssid[0] = '\0';
+    return scanAPs(keepStrongestAP, best, ssid, min_rssi) > 0;
 }
 
-// Requests page from currently-open TCP connection.  URL is
-// flash-resident string.  Returns true if request issued successfully,
+// WiFi mode = Sta, keeping the soft AP if one was started
+boolean SimpleESP8266::setStationMode()
+{
+    if (!setWifiMode(stationWifiMode()))
+    {
+        return false;
+    }
+    if (softap_ssid_)
+    {
+        //After a reset the module may bring back its default (often open)
+        //AP instead of ours, so apply the settings again
+        writeSoftAP(softap_ssid_, softap_pass_, softap_channel_);
+        return findEither(NULL, F("ERROR")) == 1;
+    }
+    return true;
+}
+
+// Returns false as soon as the module answers ERROR
+boolean SimpleESP8266::setWifiMode(uint8_t mode)
+{
+    char   tag[ESP_WIFI_MODE_TAG];
+    int    c;
+    int8_t end;
+    writeWifiMode(mode);
+    for (;;)
+    {
+        c = parseTag(tag, sizeof(tag), receive_timeout_);
+        if (c < 0)
+        {
+            return false;
+        }
+        if ((end = wifiModeReply(tag)) >= 0)
+        {
+            skipLine(receive_timeout_);
+            return end == 1;
+        }
+        if (c != '\n' && skipLine(receive_timeout_) < 0)
+        {
+            return false;
+        }
+    }
+}
+
+// Send AT+CWMODE for setWifiMode() (and EspConnectAPTask)
+void SimpleESP8266::writeWifiMode(uint8_t mode)
+{
+    if (!persist_ap_ && hasCap(ESP_CAP_CUR_DEF))
+    {
+        writeP(ESP_P("AT+CWMODE_CUR="));
+    } else
+    {
+        writeP(ESP_P("AT+CWMODE="));
+    }
+    writeNumber(mode, true);
+}
+
+// How a line of the reply to AT+CWMODE (its tag, see parseTag()) ends the
+// command: 1 for OK, or older firmware's "no change" when the module is
+// already in that mode; 0 for ERROR; -1 if it doesn't
+int8_t SimpleESP8266::wifiModeReply(const char *tag)
+{
+    if (strcmp_P(tag, PSTR("no change")) == 0)
+    {
+        return 1;
+    }
+    return responseEnd(tag);
+}
+
+uint8_t SimpleESP8266::stationWifiMode()
+{
+    return softap_ssid_ ? ESP_WIFI_BOTH : ESP_WIFI_STATION;
+}
+
+// Start the module's own access point (AT+CWSAP), so clients such as a
+// technician's laptop can join it directly, one hop away.  pass must be 8
+// to 64 characters, or NULL for an open network.  With station true the
+// module also stays (or becomes) a station, so connectToAP() still works;
+// both then use the AP's channel.  acceptTCP() serves clients on either
+// network.  The AP's own address is 192.168.4.1 by default.  Like
+// connectToAP(), the settings are saved to flash unless setPersistAP(false);
+// either way they are sent again whenever connectToAP() or scanAPs() set the
+// mode, so a reset can't leave the firmware's default AP running instead.
+// Returns true if the module accepted them.
+boolean SimpleESP8266::startSoftAP(EspStr *ssid, EspStr *pass, uint8_t channel, boolean station)
+{
+    Operation op(this, receive_timeout_);
+    clearStreamBuffer();
+    if (!setWifiMode(station ? ESP_WIFI_BOTH : ESP_WIFI_SOFTAP))
+    {
+        return false;
+    }
+    writeSoftAP(ssid, pass, channel);
+    if (findEither(NULL, F("ERROR")) != 1)
+    {
+        if (debug_) debug_->println(DEBUG_STR("Soft AP settings refused"));
+        return false;
+    }
+    softap_ssid_ = ssid;
+    softap_pass_ = pass;
+    softap_channel_ = channel;
+    return true;
+}
+
+// Back to plain station mode
+boolean SimpleESP8266::stopSoftAP()
+{
+    Operation op(this, receive_timeout_);
+    if (!setWifiMode(ESP_WIFI_STATION))
+    {
+        return false;
+    }
+    softap_ssid_ = NULL;
+    return true;
+}
+
+// Send the AT+CWSAP command for startSoftAP()
+void SimpleESP8266::writeSoftAP(EspStr *ssid, EspStr *pass, uint8_t channel)
+{
+    if (!persist_ap_ && hasCap(ESP_CAP_CUR_DEF))
+    {
+        writeP(ESP_P("AT+CWSAP_CUR=\""));
+    } else
+    {
+        writeP(ESP_P("AT+CWSAP=\""));
+    }
+    writeP(ssid);
+    writeP(ESP_P("\",\""));
+    if (pass)
+    {
+        writeP(pass);
+    }
+    writeP(ESP_P("\","));
+    writeNumber(channel);
+    writeP(ESP_P(","));
+    writeNumber(pass ? 4 : 0, true);  // WPA_WPA2_PSK or open
+}
+
+// Fill in up to max_stations entries with the stations joined to the soft
+// AP (AT+CWLIF).  Returns how many are joined, which may be more than
+// max_stations, or -1 if the module didn't answer OK.
+int8_t SimpleESP8266::listStations(EspStationInfo *stations, uint8_t max_stations)
+{
+    Operation op(this, receive_timeout_);
+    char   tag[16];
+    int    c;
+    int8_t end;
+    int8_t count = 0;
+    writeP(ESP_P("AT+CWLIF\r\n"));
+    for (;;)
+    {
+        c = parseTag(tag, sizeof(tag), receive_timeout_);
+        if (c < 0)
+        {
+            return -1;
+        }
+        if ((end = responseEnd(tag)) >= 0)
+        {
+            skipLine(receive_timeout_);
+            return end == 1 ? count : -1;
+        }
+        if (c == ',' && tag[0] >= '0' && tag[0] <= '9')
+        {
+            //192.168.4.2,18:fe:34:a0:b1:c2
+            if (count < max_stations)
+            {
+                stations[count].ip = ipFromText(tag);
+                c = parseMac(stations[count].mac, receive_timeout_);
+            }
+            count++;
+        }
+        if (c != '\n' && skipLine(receive_timeout_) < 0)
+        {
+            return -1;
+        }
+    }
+}
+
+void SimpleESP8266::closeAP(void)
+{
+    Operation op(this, receive_timeout_);
+    writeP(ESP_P("AT+CWQAP\r\n")); // Quit access point
+    find(); // Purge 'OK'
+}
+
+// Open TCP connection to an already-listening host.  Hostname is flash-resident string.
+// Returns true on successful connection, else false.
+boolean SimpleESP8266::connectTCP(EspStr *hostname, int port)
+{
+    Operation op(this, receive_timeout_);
+
+    writeP(ESP_P("AT+CIPSTART=\"TCP\",\""));
+    writeP(hostname);
+    writeP(ESP_P("\","));
+    writeNumber(port, true);
+
+    if (find())
+    {
+        host_ = hostname;
+        resetLinkStats(0);
+        linkOpened(0);
+        return true;
+    }
+    return false;
+}
+
+// Accept TCP connection.
+// Returns true on successful setup, else false.
+boolean SimpleESP8266::acceptTCP(uint16_t port)
+{
+    Operation op(this, receive_timeout_);
+    writeP(ESP_P("AT+CIPMODE=0\r\n"));
+    if (!find())
+    {
+        return false;
+    }
+    writeP(ESP_P("AT+CIPMUX=1\r\n"));
+    if (!find())
+    {
+        return false;
+    }
+    mux_ = true;
+    links_open_ = 0;
+    for (uint8_t link = 0; link < ESP_MAX_LINKS; ++link)
+    {
+        resetLinkStats(link);
+    }
+    //Have +IPD say who sent it, where the firmware is known to support it
+    if ((caps_ & ESP_CAP_PROBED) && hasCap(ESP_CAP_CIPDINFO))
+    {
+        writeP(ESP_P("AT+CIPDINFO=1\r\n"));
+        if (!find())
+        {
+            return false;
+        }
+    }
+
+    writeP(ESP_P("AT+CIPSERVER=1,"));
+    writeNumber(port, true);
+
+    if (!find())
+    {
+        return false;
+    }
+    writeP(ESP_P("AT+CIPSTO="));
+    writeNumber(client_timeout_ / 1000, true);
+    if (!find())
+    {
+        return false;
+    }
+
+    return true;
+}
+// Receive data from the network.  Blocks until an +IPD frame arrives, then
+// copies its data (or as much of it as fits) into buffer.  Any remainder of
+// the frame is returned by the next call.  lastLinkId() tells which
+// connection the data came from.  Returns the number of bytes read, or -1 on
+// timeout.
+int32_t SimpleESP8266::tcpRecv(char *buffer, uint32_t buffer_len)
+{
+    Operation op(this, data_timeout_);
+    uint32_t buffer_pos;
+    uint32_t to_read;
+    if (passive_)
+    {
+        //Wait until some link has data waiting in the module, then pull it
+        uint16_t lengths[ESP_MAX_LINKS];
+        uint32_t t0 = millis();
+        uint32_t save = receive_timeout_;
+        for (;;)
+        {
+            if (!queryRecvLen(lengths))
+            {
+                return -1;
+            }
+            for (uint8_t link = 0; link < ESP_MAX_LINKS; ++link)
+            {
+                if (lengths[link] > 0)
+                {
+                    return pullRecv(buffer, buffer_len, link);
+                }
+            }
+            if (deadlinePassed())
+            {
+                return -1;
+            }
+            if (millis() - t0 > data_timeout_)
+            {
+                last_result_ = ESP_RESULT_IDLE_TIMEOUT;
+                return -1;
+            }
+            //The module announces new data with "+IPD,<link>,<len>", so
+            //  stop waiting as soon as one shows up
+            setTimeouts(ESP_RECV_POLL_INTERVAL);
+            find(F("+IPD,"));
+            setTimeouts(save);
+        }
+    }
+    if (ipd_remaining_ == 0)
+    {
+        //Check here first for bytes available, and return if they are not
+        uint32_t t0 = millis();
+        while (!stream_->available())
+        {
+            if (deadlinePassed())
+            {
+                return -1;
+            }
+            if (millis() - t0 > data_timeout_)
+            {
+                last_result_ = ESP_RESULT_IDLE_TIMEOUT;
+                return -1;
+            }
+            idle();
+        }
+        //Wait for the +IPD header
+        if (!find(F(""), true))
+        {
+            return -1;
+        }
+    }
+    to_read = ipd_remaining_;
+    if (to_read > buffer_len)
+    {
+        to_read = buffer_len;
+    }
+    flushTx();
+    stream_->setTimeout(boundedTimeout(receive_timeout_));
+    buffer_pos = stream_->readBytes(buffer, to_read);
+    stream_->setTimeout(receive_timeout_);
+    if (buffer_pos < to_read)
+    {
+        //The rest of the frame never arrived, so resynchronize on the next header
+        ipd_remaining_ = 0;
+    } else
+    {
+        ipd_remaining_ -= buffer_pos;
+    }
+    //If there's room in the buffer, set the next character to null for good measure
+    if (buffer_pos < buffer_len)
+    {
+        buffer[buffer_pos] = '\0';
+    }
+    return buffer_pos;
+}
+
+// Switch between the module pushing received data as +IPD frames (the
+// default) and passive mode, where it holds the data until it is pulled with
+// pullRecv() (tcpRecv() does this automatically).  In passive mode the
+// module's own buffer, not our UART buffer, absorbs data we can't consume
+// yet, and TCP flow control slows the sender down once it fills.  Needs
+// ESP_CAP_CIPRECVMODE firmware.  Returns true if the module accepted it.
+boolean SimpleESP8266::setPassiveRecv(boolean passive)
+{
+    Operation op(this, receive_timeout_);
+    writeP(ESP_P("AT+CIPRECVMODE="));
+    writeNumber(passive ? 1 : 0, true);
+    if (findEither(NULL, F("ERROR")) != 1)
+    {
+        return false;
+    }
+    passive_ = passive;
+    ipd_remaining_ = 0;
+    return true;
+}
+
+// Read the "+CIPRECVLEN:<len0>,<len1>,...,<len4>" byte counts held for each
+// link in passive mode.
+boolean SimpleESP8266::queryRecvLen(uint16_t *lengths)
+{
+    int32_t value;
+    int     c = ',';
+    memset(lengths, 0, ESP_MAX_LINKS * sizeof(*lengths));
+    writeP(ESP_P("AT+CIPRECVLEN?\r\n"));
+    if (!find(F("+CIPRECVLEN:")))
+    {
+        return false;
+    }
+    for (uint8_t link = 0; link < ESP_MAX_LINKS && c == ','; ++link)
+    {
+        c = parseNumber(&value, receive_timeout_);
+        lengths[link] = value;
+    }
+    return c >= 0 && find();
+}
+
+// Number of received bytes the module holds for a link in passive mode, or
+// -1 on error.
+int32_t SimpleESP8266::pendingRecv(uint8_t link)
+{
+    Operation op(this, receive_timeout_);
+    uint16_t lengths[ESP_MAX_LINKS];
+    if (link >= ESP_MAX_LINKS || !queryRecvLen(lengths))
+    {
+        return -1;
+    }
+    return lengths[link];
+}
+
+// Pull up to buffer_len bytes held for a link in passive mode, without
+// waiting for more to arrive.  Returns the number of bytes read (0 if none
+// were waiting), or -1 on error.
+int32_t SimpleESP8266::pullRecv(char *buffer, uint32_t buffer_len, uint8_t link)
+{
+    Operation op(this, receive_timeout_);
+    int32_t  length;
+    uint32_t bytes_read;
+    int      c;
+
+    if (buffer_len > ESP_CHUNK_MAX)
+    {
+        buffer_len = ESP_CHUNK_MAX;
+    }
+    writeP(ESP_P("AT+CIPRECVDATA="));
+    if (mux_)
+    {
+        writeNumber(link);
+        writeP(ESP_P(","));
+    }
+    writeNumber(buffer_len, true);
+    //Depending on the firmware the answer is "+CIPRECVDATA,<len>:<data>"
+    //  or "+CIPRECVDATA:<len>,<data>", followed by OK
+    if (findEither(F("+CIPRECVDATA"), F("ERROR")) != 1 || readByte(receive_timeout_) < 0)
+    {
+        return -1;
+    }
+    c = parseNumber(&length, receive_timeout_);
+    if ((c != ':' && c != ',') || length < 0 || (uint32_t)length > buffer_len)
+    {
+        return -1;
+    }
+    flushTx();
+    stream_->setTimeout(boundedTimeout(receive_timeout_));
+    bytes_read = stream_->readBytes(buffer, length);
+    stream_->setTimeout(receive_timeout_);
+    ipd_link_ = link;
+    if (bytes_read > 0)
+    {
+        linkReceived(link);
+    }
+    //If there's room in the buffer, set the next character to null for good measure
+    if (bytes_read < buffer_len)
+    {
+        buffer[bytes_read] = '\0';
+    }
+    if (bytes_read < (uint32_t)length || !find())
+    {
+        return -1;
+    }
+    return bytes_read;
+}
+
+uint8_t SimpleESP8266::lastLinkId()
+{
+    return ipd_link_;
+}
+
+// Sender of the last +IPD frame.  Only known in server mode on firmware with
+// AT+CIPDINFO (see probeFirmware()), else 0.
+uint32_t SimpleESP8266::lastRemoteIp()
+{
+    return ipd_remote_ip_;
+}
+
+uint16_t SimpleESP8266::lastRemotePort()
+{
+    return ipd_remote_port_;
+}
+
+// Returns true if tcpRecv() has something to read without waiting for the
+// module: the rest of a +IPD frame, or new input (which might turn out to
+// be a status line rather than data)
+boolean SimpleESP8266::recvWaiting()
+{
+    return ipd_remaining_ > 0 || stream_->available() > 0;
+}
+
+// Send data on an open connection (link is ignored in single connection
+// mode).  The data is split into CIPSEND chunks sized for the current link
+// quality, and a chunk the module reports as "SEND FAIL" is retried after a
+// backoff.  A chunk with neither "SEND OK" nor "SEND FAIL" by the timeout
+// may still have gone out, so it isn't retried: sending it again could put
+// the same bytes on the stream twice.  header, if given, goes ahead of the data in the same CIPSEND
+// (e.g. a protocol's framing), saving a send of its own.  Returns true if
+// every chunk was sent.
+boolean SimpleESP8266::tcpSend(const uint8_t *data, uint16_t len, uint8_t link,
+                               const uint8_t *header, uint8_t header_len)
+{
+    return sendChunks(data, len, link, header, header_len, false);
+}
+
+// tcpSend() with a flash-resident header (under 256 bytes), e.g. the fixed
+// start of a reply whose end is worked out in RAM, so the two go out in one
+// CIPSEND
+boolean SimpleESP8266::tcpSendP(EspStr *header, const uint8_t *data, uint16_t len, uint8_t link)
+{
+    return sendChunks(data, len, link, (const uint8_t *)header, strlen_P((Pchr *)header), true);
+}
+
+boolean SimpleESP8266::sendChunks(const uint8_t *data, uint16_t len, uint8_t link,
+                                  const uint8_t *header, uint8_t header_len, boolean header_in_flash)
+{
+    Operation op(this, receive_timeout_);
+    EspLinkStats *stats = statsFor(link);
+    uint16_t chunk;
+    uint8_t  from_header;
+    uint8_t  attempt;
+    int8_t   result;
+    uint32_t t0;
+
+    while (header_len + len > 0)
+    {
+        result = 0;
+        //result is 0 (SEND FAIL, so try again) until the chunk is sent or times out
+        for (attempt = 0; attempt < ESP_SEND_RETRIES && result == 0; ++attempt)
+        {
+            if (attempt > 0)
+            {
+                pause(stats->retry_delay_ms);
+                if (deadlinePassed())
+                {
+                    return false;
+                }
+            }
+            //A failure shrinks the chunk, so the retry is smaller too
+            chunk = chunkSize(stats, header_len + len);
+            from_header = (chunk < header_len) ? chunk : header_len;
+            writeP(ESP_P("AT+CIPSEND="));
+            if (mux_)
+            {
+                writeNumber(link);
+                writeP(ESP_P(","));
+            }
+            writeNumber(chunk, true);
+            if (findEither(F(">"), F("ERROR")) != 1)
+            {
+                //No prompt means the link itself is gone, retrying won't help
+                recordSend(stats, false, 0);
+                return false;
+            }
+            t0 = millis();
+            if (header_in_flash)
+            {
+                writeP((const char *)header, from_header);
+            } else
+            {
+                write(header, from_header);
+            }
+            write(data, chunk - from_header);
+            result = findEither(F("SEND OK\r\n"), F("SEND FAIL\r\n"));
+            recordSend(stats, result == 1, millis() - t0);
+        }
+        if (result != 1)
+        {
+            return false;
+        }
+        header += from_header;
+        header_len -= from_header;
+        data += chunk - from_header;
+        len -= chunk - from_header;
+    }
+    return true;
+}
+
+// Close one connection in server (CIPMUX=1) mode
+boolean SimpleESP8266::closeLink(uint8_t link)
+{
+    Operation op(this, receive_timeout_);
+    writeP(ESP_P("AT+CIPCLOSE="));
+    writeNumber(link, true);
+    return findEither(NULL, F("ERROR")) == 1;
+}
+
+// Bit n is set while server link n is open.  Tracked from the module's
+// "<link>,CONNECT" and "<link>,CLOSED" lines as they go past in any command
+// (and from received data), so it's as current as the last read.  In
+// single connection mode bit 0 is the connectTCP() connection, cleared by
+// the module's "CLOSED" (or "Unlink") line.
+uint8_t SimpleESP8266::openLinks()
+{
+    return links_open_;
+}
+
+void SimpleESP8266::setLinkCallback(EspLinkCallback callback, void *context)
+{
+    link_callback_ = callback;
+    link_context_ = context;
+}
+
+// A peer that vanishes without closing (power loss, out of range) keeps its
+// link until AT+CIPSTO expires, which can be hours.  serviceLinks() probes
+// a link that has received nothing for idle_ms, by sending probe (an
+// application-level ping the peer should answer) or, without one, by
+// checking AT+CIPSTATUS still lists it.  If the probe fails, or nothing
+// arrives within another idle_ms, the link is closed so its slot is free
+// for new clients.  AT+CIPSTATUS can't tell a vanished peer from a quiet
+// one (the module lists both), so without a probe each peer must send
+// something at least every 2 * idle_ms.  A link that has received nothing
+// for dead_ms is closed without probing.  0 turns either off.
+void SimpleESP8266::setKeepalive(uint32_t idle_ms, uint32_t dead_ms, const uint8_t *probe, uint8_t probe_len)
+{
+    keepalive_idle_ = idle_ms;
+    keepalive_dead_ = dead_ms;
+    keepalive_probe_ = probe;
+    keepalive_probe_len_ = probe_len;
+}
+
+// Call regularly from loop() in server mode while no other command is in
+// progress.  Reads link events already waiting (leaving data for
+// tcpRecv()), then probes or closes quiet links as set by setKeepalive().
+// Returns the number of links closed.
+uint8_t SimpleESP8266::serviceLinks()
+{
+    Operation op(this, receive_timeout_);
+    EspStatusInfo status;
+    boolean  status_read = false;
+    uint8_t  closed = 0;
+    int      c;
+
+    while (ipd_remaining_ == 0 && stream_->available())
+    {
+        c = stream_->peek();
+        if (event_state_ == EVENT_LINE_START || event_state_ == EVENT_SKIP)
+        {
+            //Only take whole event lines (and blank ones)
+            if (c != '\r' && c != '\n' && (c < '0' || c >= '0' + ESP_MAX_LINKS))
+            {
+                break;
+            }
+            event_state_ = EVENT_LINE_START;
+        }
+        scanLinkEvent(stream_->read());
+    }
+    if (!mux_)
+    {
+        return 0;  //Keepalive is for server links
+    }
+
+    for (uint8_t link = 0; link < ESP_MAX_LINKS; ++link)
+    {
+        uint8_t  bit = 1 << link;
+        uint32_t quiet = millis() - link_rx_[link];
+        boolean  dead = false;
+        if (!(links_open_ & bit))
+        {
+            continue;
+        }
+        if (keepalive_dead_ && quiet >= keepalive_dead_)
+        {
+            dead = true;
+        } else if (keepalive_idle_ && (links_probed_ & bit))
+        {
+            //Still nothing back since the probe (linkReceived() clears the bit)
+            dead = (millis() - link_probe_[link]) >= keepalive_idle_;
+        } else if (keepalive_idle_ && quiet >= keepalive_idle_)
+        {
+            if (keepalive_probe_)
+            {
+                dead = !tcpSend(keepalive_probe_, keepalive_probe_len_, link);
+            } else
+            {
+                //One status query does for every quiet link
+                if (!status_read && !(status_read = queryStatus(&status)))
+                {
+                    continue;
+                }
+                dead = true;
+                for (uint8_t i = 0; i < status.link_count; ++i)
+                {
+                    if (status.links[i].link == link)
+                    {
+                        dead = false;
+                    }
+                }
+            }
+            links_probed_ |= bit;
+            link_probe_[link] = millis();
+        }
+        //The probe itself may have shown the link closing
+        if (dead && (links_open_ & bit))
+        {
+            if (debug_)
+            {
+                debug_->print(indent_);
+                debug_->print(DEBUG_STR("Dead link "));
+                debug_->println(link);
+            }
+            closeLink(link);
+            linkClosed(link);
+            closed++;
+        }
+    }
+    return closed;
+}
+
+// Watch the module's output for "<link>,CONNECT" and "<link>,CLOSED" lines.
+// Fed every byte find(), stepMatch() and readByte() read, so link changes
+// are seen even while waiting for something else.  Received data is
+// skipped, so a peer can't fake an event: the rest of a frame being read
+// (ipd_remaining_), and the data of any +IPD frame met along the way.
+void SimpleESP8266::scanLinkEvent(uint8_t c)
+{
+    if (ipd_remaining_ > 0)
+    {
+        return;
+    }
+    if (event_state_ == EVENT_IPD_DATA)
+    {
+        if (--event_skip_ == 0)
+        {
+            event_state_ = EVENT_LINE_START;
+        }
+        return;
+    }
+    if (c == '\n')
+    {
+        event_state_ = EVENT_LINE_START;
+        return;
+    }
+    switch (event_state_)
+    {
+    case EVENT_LINE_START:
+        if (c == '+')
+        {
+            event_link_ = 0;
+            event_state_ = EVENT_IPD;
+        } else if (mux_ && c >= '0' && c < '0' + ESP_MAX_LINKS)
+        {
+            event_link_ = c - '0';
+            event_state_ = EVENT_COMMA;
+        } else if (!mux_ && (c == 'C' || c == 'U'))
+        {
+            //The single connection's "CLOSED", or older firmware's "Unlink"
+            //(its CONNECT is seen by connectTCP(), so isn't looked for)
+            event_link_ = 0;
+            event_state_ = EVENT_WORD;
+        } else
+        {
+            event_state_ = EVENT_SKIP;
+        }
+        break;
+    case EVENT_IPD:
+        if (c != pgm_read_byte(PSTR("IPD,") + event_link_))
+        {
+            event_state_ = EVENT_SKIP;
+        } else if (++event_link_ == 4)
+        {
+            //event_link_ now counts the header's fields
+            event_link_ = 0;
+            event_skip_ = 0;
+            event_state_ = EVENT_IPD_HEADER;
+        }
+        break;
+    case EVENT_IPD_HEADER:
+        if (c == ':')
+        {
+            event_state_ = event_skip_ ? EVENT_IPD_DATA : EVENT_LINE_START;
+        } else if (c == ',')
+        {
+            event_link_++;
+        } else if (c >= '0' && c <= '9' && event_link_ == (mux_ ? 1 : 0))
+        {
+            event_skip_ = event_skip_ * 10 + (c - '0');
+        }
+        break;
+    case EVENT_COMMA:
+        event_state_ = (c == ',') ? EVENT_C : EVENT_SKIP;
+        break;
+    case EVENT_C:
+        event_state_ = (c == 'C') ? EVENT_WORD : EVENT_SKIP;
+        break;
+    case EVENT_WORD:
+        //CONNECT, CLOSED or Unlink
+        if (c == 'O' && mux_)
+        {
+            linkOpened(event_link_);
+        } else if (c == 'L' || c == 'n')
+        {
+            linkClosed(event_link_);
+        }
+        event_state_ = EVENT_TAIL;
+        break;
+    default:
+        break;
+    }
+}
+
+void SimpleESP8266::linkOpened(uint8_t link)
+{
+    links_open_ |= 1 << link;
+    link_rx_[link] = millis();
+    links_probed_ &= ~(1 << link);
+    if (link_callback_)
+    {
+        link_callback_(link, true, link_context_);
+    }
+}
+
+void SimpleESP8266::linkClosed(uint8_t link)
+{
+    if (!(links_open_ & (1 << link)))
+    {
+        return;
+    }
+    links_open_ &= ~(1 << link);
+    if (link_callback_)
+    {
+        link_callback_(link, false, link_context_);
+    }
+}
+
+// Data arrived on link, so its peer is alive.  Called once its +IPD header
+// has been parsed, which leaves the scanner part way through that header.
+void SimpleESP8266::linkReceived(uint8_t link)
+{
+    event_state_ = EVENT_LINE_START;
+    if (!mux_ || link >= ESP_MAX_LINKS)
+    {
+        return;
+    }
+    if (!(links_open_ & (1 << link)))
+    {
+        //Missed its CONNECT
+        linkOpened(link);
+        return;
+    }
+    link_rx_[link] = millis();
+    links_probed_ &= ~(1 << link);
+}
+
+// Payload size for the next CIPSEND of a connection with len bytes to go
+uint16_t SimpleESP8266::chunkSize(const EspLinkStats *stats, uint16_t len)
+{
+    uint16_t chunk = stats->chunk_size;
+    if (rssi_ != 0 && rssi_ < ESP_RSSI_WEAK && chunk > ESP_CHUNK_MAX / 2)
+    {
+        //Long frames are the first to be lost on a weak signal
+        chunk = ESP_CHUNK_MAX / 2;
+    }
+    if (chunk > len)
+    {
+        chunk = len;
+    }
+    return chunk;
+}
+
+EspLinkStats *SimpleESP8266::statsFor(uint8_t link)
+{
+    return &link_stats_[link < ESP_MAX_LINKS ? link : 0];
+}
+
+// Update a connection's statistics after a CIPSEND, and adapt its chunk size
+// and retry delay: grow the chunk gradually while sends keep succeeding, halve
+// it (and double the retry delay) as soon as one fails.
+void SimpleESP8266::recordSend(EspLinkStats *stats, boolean ok, uint32_t rtt)
+{
+    if (ok)
+    {
+        stats->send_ok++;
+        if (wake_start_)
+        {
+            wake_stats_.first_send_ms = millis() - wake_start_;
+            wake_start_ = 0;
+        }
+        //Smoothed like TCP's SRTT, with a gain of 1/8
+        if (stats->rtt_ms == 0)
+        {
+            stats->rtt_ms = rtt;
+        } else
+        {
+            stats->rtt_ms = stats->rtt_ms - (stats->rtt_ms >> 3) + (rtt >> 3);
+        }
+        if (++stats->ok_streak >= ESP_CHUNK_GROW_AFTER)
+        {
+            stats->ok_streak = 0;
+            stats->chunk_size += ESP_CHUNK_STEP;
+            if (stats->chunk_size > ESP_CHUNK_MAX)
+            {
+                stats->chunk_size = ESP_CHUNK_MAX;
+            }
+            stats->retry_delay_ms >>= 1;
+            if (stats->retry_delay_ms < ESP_RETRY_DELAY_MIN)
+            {
+                stats->retry_delay_ms = ESP_RETRY_DELAY_MIN;
+            }
+        }
+    } else
+    {
+        stats->send_fail++;
+        stats->ok_streak = 0;
+        stats->chunk_size >>= 1;
+        if (stats->chunk_size < ESP_CHUNK_MIN)
+        {
+            stats->chunk_size = ESP_CHUNK_MIN;
+        }
+        stats->retry_delay_ms <<= 1;
+        if (stats->retry_delay_ms > ESP_RETRY_DELAY_MAX)
+        {
+            stats->retry_delay_ms = ESP_RETRY_DELAY_MAX;
+        }
+    }
+}
+
+void SimpleESP8266::resetLinkStats(uint8_t link)
+{
+    EspLinkStats *stats = statsFor(link);
+    memset(stats, 0, sizeof(*stats));
+    stats->chunk_size = ESP_CHUNK_START;
+    stats->retry_delay_ms = ESP_RETRY_DELAY_MIN;
+}
+
+// Statistics for one connection (always link 0 in single connection mode)
+const EspLinkStats *SimpleESP8266::linkStats(uint8_t link)
+{
+    return statsFor(link);
+}
+
+// Signal strength of the current AP in dBm as of the last sample, 0 if unknown
+int8_t SimpleESP8266::rssi()
+{
+    return rssi_;
+}
+
+// How often serviceLinkMonitor() samples the signal strength.  0 disables it.
+void SimpleESP8266::setLinkMonitorInterval(uint32_t interval)
+{
+    monitor_interval_ = interval;
+}
+
+// Call regularly from loop() while no other command is in progress.  Samples
+// the RSSI once per monitor interval.  Returns true if a sample was taken.
+boolean SimpleESP8266::serviceLinkMonitor()
+{
+    if (monitor_interval_ == 0 || (millis() - last_monitor_) < monitor_interval_)
+    {
+        return false;
+    }
+    last_monitor_ = millis();
+    return sampleRssi();
+}
+
+// Query the current AP with AT+CWJAP? and record its RSSI.
+boolean SimpleESP8266::sampleRssi()
+{
+    EspApInfo ap;
+    if (!queryAP(&ap))
+    {
+        return false;
+    }
+    if (ap.rssi != 0)
+    {
+        rssi_ = ap.rssi;
+    }
+    return true;
+}
+
+// Fill in address with the module's IP and MAC addresses (AT+CIFSR).
+// Returns false if the module didn't answer OK.
+boolean SimpleESP8266::queryAddress(EspAddress *address)
+{
+    Operation op(this, receive_timeout_);
+    char   tag[16];   //Also holds a bare IP from old firmware
+    int    c;
+    int8_t end;
+    memset(address, 0, sizeof(*address));
+    writeP(ESP_P("AT+CIFSR\r\n"));
+    for (;;)
+    {
+        c = parseTag(tag, sizeof(tag), receive_timeout_);
+        if (c < 0)
+        {
+            return false;
+        }
+        if ((end = responseEnd(tag)) >= 0)
+        {
+            skipLine(receive_timeout_);
+            return end == 1;
+        }
+        if (c == ':' && strcmp_P(tag, PSTR("+CIFSR")) == 0)
+        {
+            //+CIFSR:STAIP,"192.168.1.5" etc.
+            c = parseTag(tag, sizeof(tag), receive_timeout_);
+            if (c == ',')
+            {
+                if (strcmp_P(tag, PSTR("STAIP")) == 0)
+                {
+                    c = parseIp(&address->ip, receive_timeout_);
+                } else if (strcmp_P(tag, PSTR("STAMAC")) == 0)
+                {
+                    c = parseMac(address->mac, receive_timeout_);
+                } else if (strcmp_P(tag, PSTR("APIP")) == 0)
+                {
+                    c = parseIp(&address->ap_ip, receive_timeout_);
+                } else if (strcmp_P(tag, PSTR("APMAC")) == 0)
+                {
+                    c = parseMac(address->ap_mac, receive_timeout_);
+                }
+            }
+        } else if (tag[0] >= '0' && tag[0] <= '9')
+        {
+            //Old firmware prints bare addresses, the station's last
+            address->ap_ip = address->ip;
+            address->ip = ipFromText(tag);
+        }
+        if (c != '\n' && skipLine(receive_timeout_) < 0)
+        {
+            return false;
+        }
+    }
+}
+
+// Fill in status with the connection state and open links (AT+CIPSTATUS).
+// Links beyond ESP_MAX_LINKS are skipped.  Returns false if the module
+// didn't answer OK.
+boolean SimpleESP8266::queryStatus(EspStatusInfo *status)
+{
+    Operation op(this, receive_timeout_);
+    char    tag[12];
+    int     c;
+    int8_t  end;
+    int32_t value;
+    memset(status, 0, sizeof(*status));
+    writeP(ESP_P("AT+CIPSTATUS\r\n"));
+    for (;;)
+    {
+        c = parseTag(tag, sizeof(tag), receive_timeout_);
+        if (c < 0)
+        {
+            return false;
+        }
+        if ((end = responseEnd(tag)) >= 0)
+        {
+            skipLine(receive_timeout_);
+            return end == 1;
+        }
+        if (c == ':' && strcmp_P(tag, PSTR("STATUS")) == 0)
+        {
+            c = parseNumber(&value, receive_timeout_);
+            status->status = value;
+        } else if (c == ':' && strcmp_P(tag, PSTR("+CIPSTATUS")) == 0 &&
+                   status->link_count < ESP_MAX_LINKS)
+        {
+            //+CIPSTATUS:<link>,"TCP","<ip>",<remote port>,[<local port>,]<0=client, 1=server>
+            EspLinkInfo *link = &status->links[status->link_count];
+            int32_t numbers[3];
+            uint8_t count = 0;
+            char    type[4];
+            c = parseNumber(&value, receive_timeout_);
+            link->link = value;
+            if (c == ',')
+            {
+                c = parseQuoted(type, sizeof(type), receive_timeout_);
+                link->type = (type[0] == 'U') ? ESP_LINK_UDP : (type[0] == 'S') ? ESP_LINK_SSL : ESP_LINK_TCP;
+            }
+            if (c == ',')
+            {
+                c = parseIp(&link->remote_ip, receive_timeout_);
+            }
+            while (c == ',' && count < 3)
+            {
+                c = parseNumber(&numbers[count++], receive_timeout_);
+            }
+            if (count >= 2)
+            {
+                link->remote_port = numbers[0];
+                link->local_port = (count == 3) ? numbers[1] : 0;
+                link->server = (numbers[count - 1] == 1);
+                status->link_count++;
+            }
+        }
+        if (c != '\n' && skipLine(receive_timeout_) < 0)
+        {
+            return false;
+        }
+    }
+}
+
+// Fill in ap with the access point the module is joined to (AT+CWJAP?).
+// The answer is +CWJAP:"ssid","bssid",channel,rssi; older firmware only
+// gives the ssid, leaving the rest 0.  ecn isn't reported.  Returns false if
+// not joined to an AP.
+boolean SimpleESP8266::queryAP(EspApInfo *ap)
+{
+    Operation op(this, receive_timeout_);
+    char    tag[8];
+    int     c;
+    int8_t  end;
+    int32_t value;
+    boolean joined = false;
+    memset(ap, 0, sizeof(*ap));
+    writeP(ESP_P("AT+CWJAP?\r\n"));
+    for (;;)
+    {
+        c = parseTag(tag, sizeof(tag), receive_timeout_);
+        if (c < 0)
+        {
+            return false;
+        }
+        if ((end = responseEnd(tag)) >= 0)
+        {
+            skipLine(receive_timeout_);
+            return end == 1 && joined;
+        }
+        if (c == ':' && strcmp_P(tag, PSTR("+CWJAP")) == 0)
+        {
+            joined = true;
+            c = parseQuoted(ap->ssid, sizeof(ap->ssid), receive_timeout_);
+            if (c == ',')
+            {
+                c = parseMac(ap->mac, receive_timeout_);
+            }
+            if (c == ',')
+            {
+                c = parseNumber(&value, receive_timeout_);
+                ap->channel = value;
+            }
+            if (c == ',')
+            {
+                c = parseNumber(&value, receive_timeout_);
+                ap->rssi = value;
+            }
+        }
+        if (c != '\n' && skipLine(receive_timeout_) < 0)
+        {
+            return false;
+        }
+    }
+}
+
+
+// Close previously accepted TCP stream
+// Returns true on successful unaccept, else false.
+boolean SimpleESP8266::unacceptTCP()
+{
+    Operation op(this, receive_timeout_);
+
+    writeP(ESP_P("AT+CIPSERVER=0\r\n"));
+
+    if (find())
+    {
+        //The device responds "OK" and then closes the current connections, so discard any additional input that comes
+        clearStreamBuffer();
+        return true;
+    }
+    return false;
+}
+
+void SimpleESP8266::closeTCP(void)
+{
+    Operation op(this, receive_timeout_);
+    writeP(ESP_P("AT+CIPCLOSE\r\n"));
+    if ((caps_ & ESP_CAP_PROBED) && !(caps_ & ESP_CAP_CLOSED))
+    {
+        find(F("Unlink\r\n"));
+    } else
+    {
+        //Newer firmware answers "CLOSED" then OK and never says "Unlink"
+        findEither(NULL, F("ERROR"));
+    }
+}
+
+// Requests page from currently-open TCP connection.  URL is
+// flash-resident string.  Returns true if request issued successfully,
 // else false.  Calling function should then handle data returned, may
 // need to parse IPD delimiters (see notes in find() function.
 boolean SimpleESP8266::requestURL(EspStr *url)
 {
-    this->print(F("AT+CIPSEND="));
-    this->println(25 + strlen_P((Pchr *)url) + strlen_P((Pchr *)host_));
+    Operation op(this, receive_timeout_);
+    writeP(ESP_P("AT+CIPSEND="));
+    writeNumber(http_overhead + strlen_P((Pchr *)url) + strlen_P((Pchr *)host_), true);
 
     //if (find(F("> ")))
     //{ // Wait for prompt
-    this->print(F("GET ")); // 4
-    this->print(url);
-    this->print(F(" HTTP/1.1\r\nHost: ")); // 17
-    this->print(host_);
-    this->print(F("\r\n\r\n")); // 4
-    return(find()); // Gets 'SEND OK' line
+    writeP(ESP_P(ESP_HTTP_GET));
+    writeP(url);
+    writeP(ESP_P(ESP_HTTP_HOST));
+    writeP(host_);
+    uint32_t t0 = millis();
+    writeP(ESP_P(ESP_HTTP_END));
+    boolean sent = find(); // Gets 'SEND OK' line
+    recordSend(&link_stats_[0], sent, millis() - t0);
+    return sent;
                     //}
-    return false;
 }
 
 // Requests page from currently-open TCP connection.  URL is
@@ -646,23 +2804,274 @@ boolean SimpleESP8266::requestURL(EspStr *url)
 // need to parse IPD delimiters (see notes in find() function.
 boolean SimpleESP8266::requestURL(char* url)
 {
-    this->print(F("AT+CIPSEND="));
-    //25 indicates length of total message, and is sizeof("GET HTTP/1.1\r\nHost: \r\n\r\n")
-    this->println(25 + strlen(url) + strlen_P((Pchr *)host_));
+    Operation op(this, receive_timeout_);
+    writeP(ESP_P("AT+CIPSEND="));
+    writeNumber(http_overhead + strlen(url) + strlen_P((Pchr *)host_), true);
     if (find(F("> ")))
     { // Wait for prompt
-        this->print(F("GET ")); // 4
-        this->print(url);
-        this->print(F(" HTTP/1.1\r\nHost: ")); // 17
-        this->print(host_);
-        this->print(F("\r\n\r\n")); // 4
-        return(find()); // Gets 'SEND OK' line
+        writeP(ESP_P(ESP_HTTP_GET));
+        write((const uint8_t *)url, strlen(url));
+        writeP(ESP_P(ESP_HTTP_HOST));
+        writeP(host_);
+        uint32_t t0 = millis();
+        writeP(ESP_P(ESP_HTTP_END));
+        boolean sent = find(); // Gets 'SEND OK' line
+        recordSend(&link_stats_[0], sent, millis() - t0);
+        return sent;
     }
     return false;
 }
 
+// Identify the AT firmware with AT+GMR and check which optional commands it
+// accepts, so each command path can use the fastest variant the firmware
+// supports and look for the response it will really send.  Called by
+// setupTcpServer(); call it after softReset() when setting up by hand.
+// Until it has run every capability is assumed except CIPRECVMODE.
+// Returns true if the module answered.
+boolean SimpleESP8266::probeFirmware()
+{
+    Operation op(this, receive_timeout_);
+    int32_t major;
+    int32_t minor = 0;
+    int8_t  result;
+
+    caps_ = 0;
+    at_version_ = 0;
+    //Firmware before AT 0.21 only prints a bare number like "0018000902"
+    writeP(ESP_P("AT+GMR\r\n"));
+    result = findEither(F("AT version:"), F("OK\r\n"));
+    if (result < 0)
+    {
+        return false;
+    }
+    if (result == 1)
+    {
+        if (parseNumber(&major, receive_timeout_) == '.')
+        {
+            parseNumber(&minor, receive_timeout_);
+        }
+        at_version_ = (major << 8) | (minor & 0xFF);
+        if (!find())
+        {
+            return false;
+        }
+        caps_ |= ESP_CAP_CLOSED;
+        if (at_version_ >= 0x0028) // 0.40
+        {
+            caps_ |= ESP_CAP_GOT_IP;
+        }
+    }
+    //The rest are cheaper to just try than to tabulate per version
+    if (probeCommand(F("AT+UART_CUR?")))
+    {
+        caps_ |= ESP_CAP_UART_CUR;
+    }
+    if (probeCommand(F("AT+CWMODE_CUR?")))
+    {
+        caps_ |= ESP_CAP_CUR_DEF;
+    }
+    if (probeCommand(F("AT+CIPDINFO?")))
+    {
+        caps_ |= ESP_CAP_CIPDINFO;
+    }
+    if (probeCommand(F("AT+CIPRECVMODE?")))
+    {
+        caps_ |= ESP_CAP_CIPRECVMODE;
+    }
+    caps_ |= ESP_CAP_PROBED;
+    if (debug_)
+    {
+        debug_->print(indent_);
+        debug_->print(DEBUG_STR("AT version "));
+        debug_->print(at_version_ >> 8);
+        debug_->print(DEBUG_STR("."));
+        debug_->print(at_version_ & 0xFF);
+        debug_->print(DEBUG_STR(" caps 0x"));
+        debug_->println(caps_, HEX);
+    }
+    return true;
+}
+
+// Returns true if the firmware accepts the given query command
+boolean SimpleESP8266::probeCommand(EspStr *query)
+{
+    writeP(query);
+    writeP(ESP_P("\r\n"));
+    return findEither(NULL, F("ERROR")) == 1;
+}
+
+boolean SimpleESP8266::hasCap(uint8_t cap)
+{
+    if (!(caps_ & ESP_CAP_PROBED))
+    {
+        return cap != ESP_CAP_CIPRECVMODE;
+    }
+    return (caps_ & cap) != 0;
+}
+
+uint8_t SimpleESP8266::capabilities()
+{
+    return caps_;
+}
+
+uint16_t SimpleESP8266::firmwareVersion()
+{
+    return at_version_;
+}
+
+// By default connectToAP() saves the AP (and station mode) to the module's
+// flash, which deepSleep()/wakeAndConnectTCP() rely on to rejoin it.  Passing
+// false uses the _CUR commands where supported, which skip the flash write.
+void SimpleESP8266::setPersistAP(boolean persist)
+{
+    persist_ap_ = persist;
+}
+
+// Set the module's power saving mode while associated (ESP_SLEEP_NONE,
+// ESP_SLEEP_LIGHT or ESP_SLEEP_MODEM).  Returns true if accepted.
+boolean SimpleESP8266::setSleepMode(uint8_t mode)
+{
+    Operation op(this, receive_timeout_);
+    writeP(ESP_P("AT+SLEEP="));
+    writeNumber(mode, true);
+    return findEither(NULL, F("ERROR")) == 1;
+}
+
+// Put the module into deep sleep.  It only wakes by itself after sleep_ms if
+// GPIO16 is wired to its RST; otherwise pass 0 and let wakeAndConnectTCP()
+// pulse the reset pin.  The module keeps the AP it was last joined to and
+// rejoins it automatically on wake.
+boolean SimpleESP8266::deepSleep(uint32_t sleep_ms)
+{
+    Operation op(this, receive_timeout_);
+    writeP(ESP_P("AT+GSLP="));
+    writeNumber(sleep_ms, true);
+    if (findEither(NULL, F("ERROR")) != 1)
+    {
+        return false;
+    }
+    asleep_ = true;
+    host_ = NULL;
+    return true;
+}
+
+// Fast path from deep sleep to an open TCP connection.  Unlike
+// setupTcpServer() this skips softReset() and connectToAP() (and their fixed
+// delays): it waits only as long as the module actually takes to boot and
+// rejoin the AP it was associated with before sleeping.  The time each step
+// took, and the time until the first SEND OK, are reported by wakeStats().
+// Returns true once the connection is open.
+boolean SimpleESP8266::wakeAndConnectTCP(EspStr *host, int port)
+{
+    Operation op(this, reset_timeout_ + connect_timeout_);
+    boolean booted = false;
+    boolean pulsed = false;
+    uint32_t save = receive_timeout_;
+    uint32_t t0;
+
+    wake_start_ = millis();
+    memset(&wake_stats_, 0, sizeof(wake_stats_));
+    if (asleep_ && reset_pin_ >= 0)
+    {
+        digitalWrite(reset_pin_, LOW);
+        pinMode(reset_pin_, OUTPUT); // Open drain; reset -> GND
+        delay(10);                   // Hold a moment
+        pinMode(reset_pin_, INPUT);  // Back to high-impedance pin state
+        pulsed = true;
+    }
+    asleep_ = false;
+    if (pulsed)
+    {
+        setTimeouts(reset_timeout_);
+        booted = find((EspStr *)defaultBootMarker);
+        setTimeouts(save);
+    }
+    if (!booted)
+    {
+        //Without a reset pulse (e.g. a GPIO16 timer wake) the module may be
+        //  up already or still booting, so ask it rather than wait for a
+        //  boot message that may have come and gone
+        t0 = millis();
+        setTimeouts(ESP_WAKE_POLL_INTERVAL);
+        do
+        {
+            writeP(ESP_P("AT\r\n"));
+            booted = find();
+        } while (!booted && (millis() - t0) < reset_timeout_ && !deadlinePassed());
+        setTimeouts(save);
+        if (!booted)
+        {
+            wake_start_ = 0;
+            return false;
+        }
+    }
+    wake_stats_.boot_ms = millis() - wake_start_;
+
+    //Echo comes back on after every boot
+    writeP(ESP_P("ATE0\r\n"));
+    if (!find() || !waitForIP())
+    {
+        wake_start_ = 0;
+        return false;
+    }
+    wake_stats_.ip_ms = millis() - wake_start_;
+
+    //CIPMUX also reverts to single connection mode on boot
+    mux_ = false;
+    links_open_ = 0;
+    if (!connectTCP(host, port))
+    {
+        wake_start_ = 0;
+        return false;
+    }
+    wake_stats_.connect_ms = millis() - wake_start_;
+    return true;
+}
+
+// Wait (up to the AP connect timeout) until the module has rejoined its AP
+// and has an IP address.  Returns as soon as "WIFI GOT IP" is printed, and
+// also polls AT+CIPSTATUS for firmware that doesn't print it.
+boolean SimpleESP8266::waitForIP()
+{
+    int32_t  status;
+    boolean  got_ip = false;
+    uint32_t save = receive_timeout_;
+    uint32_t t0 = millis();
+
+    while (!got_ip && (millis() - t0) < connect_timeout_ && !deadlinePassed())
+    {
+        if (hasCap(ESP_CAP_GOT_IP))
+        {
+            setTimeouts(ESP_IP_POLL_INTERVAL);
+            got_ip = find(F("WIFI GOT IP\r\n"));
+            setTimeouts(save);
+            if (got_ip)
+            {
+                break;
+            }
+        } else
+        {
+            pause(ESP_IP_POLL_INTERVAL);
+        }
+        //STATUS:2 = got IP, 3 = connected, 4 = disconnected, 5 = not associated
+        writeP(ESP_P("AT+CIPSTATUS\r\n"));
+        if (find(F("STATUS:")) && parseNumber(&status, receive_timeout_) >= 0)
+        {
+            got_ip = (status >= 2 && status <= 4);
+        }
+        find();
+    }
+    return got_ip;
+}
+
+const EspWakeStats *SimpleESP8266::wakeStats()
+{
+    return &wake_stats_;
+}
+
 boolean SimpleESP8266::setupTcpServer(EspStr *ssid, EspStr* password, uint16_t port)
 {
+    Operation op(this, 2 * reset_timeout_ + connect_timeout_);
     // Test if module is ready
     if (debug_) debug_->println(DEBUG_STR("\r\nHard reset"));
     if (!this->hardReset())
@@ -680,34 +3089,60 @@ boolean SimpleESP8266::setupTcpServer(EspStr *ssid, EspStr* password, uint16_t p
     }
     if (debug_) debug_->println(DEBUG_STR("OK."));
 
-    if (debug_) debug_->print(DEBUG_STR("\r\nConnect to WiFi"));
-    if (this->connectToAP(ssid, password))
+    if (debug_) debug_->print(DEBUG_STR("\r\nProbe firmware"));
+    if (!this->probeFirmware())
+    {
+        if (debug_) debug_->println(DEBUG_STR("no response from module."));
+        return false;
+    }
+
+    if (softap_ssid_ && !ssid)
     {
-        char buffer[40];
-        // IP addr check isn't part of library yet, but
-        // we can manually request and place in a string.
-        if (debug_) debug_->print(DEBUG_STR("OK\nCheck IP addr"));
-        this->println(F("AT+CIFSR"));
-        if (this->readLine(buffer, sizeof(buffer)))
+        //The reset lost the soft AP if it wasn't saved to flash.  (With a
+        //station too, connectToAP() brings it back.)
+        if (debug_) debug_->print(DEBUG_STR("\r\nStart soft AP"));
+        if (!this->startSoftAP(softap_ssid_, softap_pass_, softap_channel_, false))
         {
-            this->find(); // Discard the 'OK' that follows
+            if (debug_) debug_->println(DEBUG_STR("Fail to start soft AP"));
+            return false;
+        }
+        if (debug_) debug_->println(DEBUG_STR("OK."));
+    }
 
-            if (debug_) debug_->print(DEBUG_STR("Accept TCP conn"));
-            if (this->acceptTCP(port))
-            {
-                if (debug_) debug_->println(DEBUG_STR("TCP conn accepted"));
-                return true;
-            } else
-            { // TCP connect failed
-                if (debug_) debug_->println(DEBUG_STR("Fail to accept TCP conn"));
-            }
-        } else
-        { // IP addr check failed
-            if (debug_) debug_->println(DEBUG_STR("Fail to read IP addr"));
+    if (ssid)
+    {
+        if (debug_) debug_->print(DEBUG_STR("\r\nConnect to WiFi"));
+        if (!this->connectToAP(ssid, password))
+        { // WiFi connection failed
+            if (debug_) debug_->println(DEBUG_STR("Fail to connect to AP"));
+            return false;
         }
-    } else
-    { // WiFi connection failed
-        if (debug_) debug_->println(DEBUG_STR("Fail to connect to AP"));
+        if (debug_) debug_->print(DEBUG_STR("OK\n"));
     }
-    return false;
+
+    EspAddress address;
+    if (debug_) debug_->print(DEBUG_STR("Check IP addr"));
+    if (!this->queryAddress(&address) || (ssid ? address.ip : address.ap_ip) == 0)
+    { // IP addr check failed
+        if (debug_) debug_->println(DEBUG_STR("Fail to read IP addr"));
+        return false;
+    }
+    if (debug_)
+    {
+        uint32_t ip = ssid ? address.ip : address.ap_ip;
+        for (int8_t shift = 24; shift >= 0; shift -= 8)
+        {
+            debug_->print((ip >> shift) & 0xFF);
+            if (shift) debug_->print('.');
+        }
+        debug_->println();
+    }
+    if (debug_) debug_->print(DEBUG_STR("Accept TCP conn"));
+    if (!this->acceptTCP(port))
+    { // TCP connect failed
+        if (debug_) debug_->println(DEBUG_STR("Fail to accept TCP conn"));
+        return false;
+    }
+    if (debug_) debug_->println(DEBUG_STR("TCP conn accepted"));
+    return true;
 }
\ No newline at end of file
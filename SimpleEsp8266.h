@@ -20,6 +20,7 @@ MIT license, all text above must be included in any redistribution.
 //#undef SERIAL_RX_BUFFER_SIZE
 //#define SERIAL_RX_BUFFER_SIZE 256
 #include <Arduino.h>
+#include "EspIdle.h"
 
 #define ESP_RECEIVE_TIMEOUT   5000     //Time (in milliseconds) to wait for generic responses from the device
 #define ESP_RESET_TIMEOUT     5000     //Time (in milliseconds) to wait for device to reboot during a soft reset
@@ -27,6 +28,48 @@ MIT license, all text above must be included in any redistribution.
 #define ESP_CLIENT_TIMEOUT    7200000  //Time (in milliseconds) to wait for a TCP connection
 #define ESP_DATA_TIMEOUT      7200000  //Time (in milliseconds) to wait for data after TCP connection established
 
+#define ESP_COMMAND_BUDGET    20000    //Time (in milliseconds) an operation may take on top of its own timeouts (see setCommandBudget())
+#define ESP_TX_PACE           10       //Time (in milliseconds) to wait before starting each command so the module can keep up
+#define ESP_MAX_LINKS         5        //Simultaneous connections supported by the module in CIPMUX=1 mode
+#define ESP_CHUNK_START       256      //Initial CIPSEND payload size (bytes) for a new connection
+#define ESP_CHUNK_MIN         64       //Smallest CIPSEND payload used when sends are failing
+#define ESP_CHUNK_MAX         2048     //Largest payload the module accepts in one CIPSEND
+#define ESP_CHUNK_STEP        128      //Amount the payload grows by on a clean link
+#define ESP_CHUNK_GROW_AFTER  4        //Consecutive SEND OKs needed before the payload grows
+#define ESP_SEND_RETRIES      3        //Attempts per chunk before tcpSend gives up
+#define ESP_RETRY_DELAY_MIN   10       //Time (in milliseconds) to wait before resending a failed chunk on a clean link
+#define ESP_RETRY_DELAY_MAX   1000     //Longest backoff (in milliseconds) between resends
+#define ESP_RSSI_WEAK         -80      //Signal (in dBm) below which payloads are capped at half of ESP_CHUNK_MAX
+#define ESP_MONITOR_INTERVAL  30000    //Time (in milliseconds) between RSSI samples taken by serviceLinkMonitor()
+#define ESP_KEEPALIVE_IDLE    0        //Time (in milliseconds) a server link may receive nothing before serviceLinks() probes it, 0 for never
+#define ESP_KEEPALIVE_DEAD    0        //Time (in milliseconds) a server link may receive nothing before serviceLinks() closes it, 0 for never
+
+#define ESP_IP_POLL_INTERVAL  100      //Time (in milliseconds) between IP checks while waiting for the module to rejoin its AP after waking
+#define ESP_WAKE_POLL_INTERVAL 100     //Time (in milliseconds) between "AT" probes while a module woken without a reset pulse boots
+
+#define ESP_RECV_POLL_INTERVAL 50      //Time (in milliseconds) between AT+CIPRECVLEN? polls while tcpRecv waits in passive mode
+#define ESP_TX_SERVICE_BYTES  8        //Suggested unsized_bytes for setTxQueue() with a stream that can't say how much room it has (e.g. SoftwareSerial)
+#define ESP_BRIDGE_BLOCK      64       //Most bytes bridge() copies in one go in each direction
+#ifdef SERIAL_RX_BUFFER_SIZE
+#define ESP_BRIDGE_RX_FULL    (SERIAL_RX_BUFFER_SIZE - 1) //Bytes waiting in a stream at which bridge() assumes some were dropped
+#else
+#define ESP_BRIDGE_RX_FULL    63
+#endif
+
+//Firmware capabilities found by probeFirmware()
+#define ESP_CAP_UART_CUR      0x01     //AT+UART_CUR (otherwise only AT+CIOBAUD)
+#define ESP_CAP_CUR_DEF       0x02     //_CUR variants of CWMODE/CWJAP etc. that don't write flash
+#define ESP_CAP_CIPDINFO      0x04     //AT+CIPDINFO (remote IP/port in +IPD)
+#define ESP_CAP_CIPRECVMODE   0x08     //AT+CIPRECVMODE (passive receive)
+#define ESP_CAP_CLOSED        0x10     //Closed links are reported as "CLOSED" (older firmware says "Unlink")
+#define ESP_CAP_GOT_IP        0x20     //Prints "WIFI GOT IP" once associated
+#define ESP_CAP_PROBED        0x80     //probeFirmware() has run; without this the other bits are guesses
+
+//Module power saving modes for setSleepMode()
+#define ESP_SLEEP_NONE        0
+#define ESP_SLEEP_LIGHT       1        //CPU and radio off between DTIM beacons
+#define ESP_SLEEP_MODEM       2        //Radio off between DTIM beacons (the module's default)
+
 #ifdef _VMICRO_INTELLISENSE
     //The VMICRO environment doesn't have an accurate F definition, so replace it here
     #undef F
@@ -34,8 +77,146 @@ MIT license, all text above must be included in any redistribution.
 #endif
 typedef const __FlashStringHelper EspStr; // PROGMEM/flash-resident string
 
+// A string literal placed in flash, followed by its length as worked out by
+// the compiler: the two arguments SimpleESP8266::writeP() takes
+#define ESP_P(string_literal) PSTR(string_literal), (sizeof(string_literal) - 1)
+#define ESP_WRITE_BLOCK       16       //Bytes copied out of flash per write while sending a command
+
 const char defaultBootMarker[] PROGMEM = "ready\r\n";
 
+#define ESP_SSID_MAX_LEN      32       //Longest SSID the module will report
+
+// One access point as reported by AT+CWLAP
+struct EspApInfo
+{
+    uint8_t ecn;                          //0=open, 1=WEP, 2=WPA_PSK, 3=WPA2_PSK, 4=WPA_WPA2_PSK
+    char    ssid[ESP_SSID_MAX_LEN + 1];
+    int8_t  rssi;                         //dBm
+    uint8_t mac[6];
+    uint8_t channel;
+};
+//Called by scanAPs() once per access point, as soon as its line has been parsed
+typedef void (*EspApCallback)(const EspApInfo *ap, void *context);
+
+// IPv4 addresses are kept as a uint32_t with the first octet in the top
+// byte, so 192.168.4.1 is ESP_IP(192, 168, 4, 1) == 0xC0A80401
+#define ESP_IP(a, b, c, d)    (((uint32_t)(a) << 24) | ((uint32_t)(b) << 16) | ((uint32_t)(c) << 8) | (uint32_t)(d))
+
+// The module's own addresses as reported by AT+CIFSR.  Zero if not reported
+// (e.g. the soft AP ones in station mode).
+struct EspAddress
+{
+    uint32_t ip;             //Station IP
+    uint8_t  mac[6];         //Station MAC
+    uint32_t ap_ip;          //Soft AP IP
+    uint8_t  ap_mac[6];      //Soft AP MAC
+};
+
+// WiFi modes (AT+CWMODE)
+#define ESP_WIFI_STATION      1
+#define ESP_WIFI_SOFTAP       2
+#define ESP_WIFI_BOTH         3        //Station and soft AP at once (both on the AP's channel)
+#define ESP_SOFTAP_CHANNEL    1        //Default channel for startSoftAP()
+#define ESP_WIFI_MODE_TAG     12       //Room for the longest AT+CWMODE reply line that matters ("no change")
+
+// One station joined to the module's soft AP, as reported by AT+CWLIF
+struct EspStationInfo
+{
+    uint32_t ip;
+    uint8_t  mac[6];
+};
+
+#define ESP_LINK_TCP          0
+#define ESP_LINK_UDP          1
+#define ESP_LINK_SSL          2
+
+// One open connection as reported by AT+CIPSTATUS
+struct EspLinkInfo
+{
+    uint32_t remote_ip;
+    uint16_t remote_port;
+    uint16_t local_port;     //0 on firmware that doesn't report it
+    uint8_t  link;
+    uint8_t  type;           //ESP_LINK_ value
+    boolean  server;         //true if the module accepted the connection
+};
+
+// Answer to AT+CIPSTATUS
+struct EspStatusInfo
+{
+    uint8_t     status;      //2 = got IP, 3 = connected, 4 = disconnected, 5 = not associated
+    uint8_t     link_count;  //Entries of links[] filled in
+    EspLinkInfo links[ESP_MAX_LINKS];
+};
+
+//Called when a server link opens or closes.  It may be called from inside
+//  another command, so it mustn't send commands itself.
+typedef void (*EspLinkCallback)(uint8_t link, boolean open, void *context);
+
+//Called by serviceTx() once everything queued has been handed to the UART
+typedef void (*EspTxCallback)(void *context);
+
+// Send statistics and adaptive send parameters for one connection
+struct EspLinkStats
+{
+    uint16_t send_ok;        //CIPSENDs answered with SEND OK
+    uint16_t send_fail;      //CIPSENDs answered with SEND FAIL, ERROR or nothing
+    uint16_t rtt_ms;         //Smoothed time from writing the payload to SEND OK
+    uint16_t chunk_size;     //Current CIPSEND payload size
+    uint16_t retry_delay_ms; //Current backoff before resending a failed chunk
+    uint8_t  ok_streak;      //SEND OKs since the payload size last changed
+};
+
+// Timestamps of the last wakeAndConnectTCP(), in milliseconds after it
+// started.  0 means the step has not completed.
+struct EspWakeStats
+{
+    uint32_t boot_ms;        //Module answered after reset/wake
+    uint32_t ip_ms;          //Rejoined the saved AP and has an IP address
+    uint32_t connect_ms;     //TCP connection open
+    uint32_t first_send_ms;  //First SEND OK after waking
+};
+
+// Traffic through the last (or current) bridge()
+struct EspBridgeStats
+{
+    uint32_t to_module;      //Bytes copied from the debug stream to the module
+    uint32_t to_host;        //Bytes copied from the module to the debug stream
+    uint16_t overruns;       //Times a receive buffer was found full, so bytes were probably lost
+};
+//Called after the module's baud rate is changed so the sketch can change its own
+typedef void (*EspBaudCallback)(uint32_t baud, void *context);
+
+// Why the last public operation ended (see lastResult())
+enum EspResult
+{
+    ESP_RESULT_OK = 0,           //No wait timed out and the module reported no error
+    ESP_RESULT_ERROR,            //The module answered with an error
+    ESP_RESULT_IDLE_TIMEOUT,     //The module went quiet for longer than the receive timeout
+    ESP_RESULT_DEADLINE          //The operation's deadline passed (even if data was still arriving)
+};
+
+// Result of a step of a non-blocking operation (see SimpleEsp8266Tasks.h)
+enum EspStatus
+{
+    ESP_ERROR = -1,
+    ESP_PENDING = 0,
+    ESP_DONE = 1
+};
+
+// Progress of a non-blocking search for a success or failure string in the
+// module's output
+struct EspMatch
+{
+    EspStr   *success;
+    EspStr   *failure;         //May be NULL
+    uint8_t   success_matched;
+    uint8_t   failure_matched;
+    boolean   timed_out;
+    uint32_t  timeout;         //Longest gap (in milliseconds) allowed between bytes
+    uint32_t  t_last;          //millis() when the last byte arrived
+};
+
 // Subclassing Print makes debugging easier -- output en route to
 // WiFi module can be duplicated on a second stream (e.g. Serial).
 class SimpleESP8266 : public Print
@@ -46,7 +227,9 @@ public:
     boolean softReset(void);
     boolean find(EspStr *str = NULL, boolean ipd = false, boolean verbose = false);
     void setupUART(uint32_t baud = 115200, uint8_t data_bits = 8, uint8_t stop_bits = 1, uint8_t parity = 0, uint8_t flow_control = 0);
-    boolean connectToAP(EspStr *ssid, EspStr *pass);
+    boolean connectToAP(EspStr *ssid, EspStr *pass, const uint8_t *bssid = NULL);
+    int16_t scanAPs(EspApCallback callback, void *context = NULL, EspStr *ssid = NULL, int8_t min_rssi = -128);
+    boolean findStrongestAP(EspApInfo *best, EspStr *ssid = NULL, int8_t min_rssi = -128);
     boolean connectTCP(EspStr *host, int port);
     boolean acceptTCP(uint16_t port);
     boolean unacceptTCP();
@@ -56,6 +239,9 @@ public:
     void    closeAP(void);
     void    closeTCP(void);
     void    debugLoop(void);
+    boolean bridge(uint32_t baud = 0, int8_t gpio0_pin = -1, uint32_t quiet_ms = 0);
+    const EspBridgeStats *bridgeStats();
+    void    setBaudCallback(EspBaudCallback callback, void *context = NULL);
     void    setTimeouts(uint32_t receive_timeout = 0, 
                         uint32_t reset_timeout = 0, 
                         uint32_t ap_connect_timeout = 0, 
@@ -64,12 +250,85 @@ public:
     void    setDefaultTimeouts();
     void    clearStreamBuffer();
     void    setDebug(Stream *debug = NULL);
+    void    setDeadline(uint32_t deadline);
+    void    setCommandBudget(uint32_t budget);
+    void    setIdleStrategy(uint8_t strategy, EspIdleCallback callback = NULL, void *context = NULL);
+    EspResult lastResult();
 
     //Most people will just want the function below: this will reset the device, set it up, and start a TCP server
     //Returns true if the server is waiting for data, false if an error ocurred.
+    //Pass a NULL ssid to serve only on the soft AP set up by startSoftAP().
     boolean setupTcpServer(EspStr *ssid, EspStr* password, uint16_t port = 80);
     int32_t tcpRecv(char *buffer, uint32_t buffer_len);
+    uint8_t lastLinkId();
+    uint32_t lastRemoteIp();
+    uint16_t lastRemotePort();
+    boolean recvWaiting();
+    boolean tcpSend(const uint8_t *data, uint16_t len, uint8_t link = 0,
+                    const uint8_t *header = NULL, uint8_t header_len = 0);
+    boolean tcpSendP(EspStr *header, const uint8_t *data, uint16_t len, uint8_t link = 0);
+    boolean closeLink(uint8_t link);
+
+    //Server link tracking and dead-peer detection
+    uint8_t openLinks();
+    void    setLinkCallback(EspLinkCallback callback, void *context = NULL);
+    void    setKeepalive(uint32_t idle_ms, uint32_t dead_ms = 0, const uint8_t *probe = NULL, uint8_t probe_len = 0);
+    uint8_t serviceLinks();
+
+    //Passive (pull) receive mode
+    boolean setPassiveRecv(boolean passive);
+    int32_t pendingRecv(uint8_t link = 0);
+    int32_t pullRecv(char *buffer, uint32_t buffer_len, uint8_t link = 0);
+
+    //Queued transmit: output goes to a ring buffer that serviceTx() drains
+    void     setTxQueue(uint8_t *buffer, uint16_t size, boolean from_interrupt = false, uint8_t unsized_bytes = 0);
+    void     setTxCallback(EspTxCallback callback, void *context = NULL);
+    uint16_t txPending();
+    boolean  serviceTx();
+    void     flushTx();
+
+    //Link quality monitoring
+    const EspLinkStats *linkStats(uint8_t link = 0);
+    int8_t  rssi();
+    void    setLinkMonitorInterval(uint32_t interval);
+    boolean serviceLinkMonitor();
+    boolean sampleRssi();
+
+    //Module state, parsed straight from the serial stream
+    boolean queryAddress(EspAddress *address);
+    boolean queryStatus(EspStatusInfo *status);
+    boolean queryAP(EspApInfo *ap);
+
+    //Soft AP, on its own or alongside the station
+    boolean startSoftAP(EspStr *ssid, EspStr *pass = NULL, uint8_t channel = ESP_SOFTAP_CHANNEL, boolean station = false);
+    boolean stopSoftAP();
+    int8_t  listStations(EspStationInfo *stations, uint8_t max_stations);
+
+    //Firmware capabilities
+    boolean  probeFirmware();
+    uint8_t  capabilities();
+    uint16_t firmwareVersion();
+    void     setPersistAP(boolean persist);
+
+    //Power management
+    boolean setSleepMode(uint8_t mode);
+    boolean deepSleep(uint32_t sleep_ms = 0);
+    boolean wakeAndConnectTCP(EspStr *host, int port);
+    const EspWakeStats *wakeStats();
 private:
+    friend class EspTask;
+
+    // Bounds a public operation, and everything it calls, by a deadline.
+    // Nested operations share the outermost one's deadline.
+    class Operation
+    {
+    public:
+        Operation(SimpleESP8266 *esp, uint32_t timeout);
+        ~Operation();
+    private:
+        SimpleESP8266 *esp_;
+    };
+
     Stream    *stream_;     // -> ESP8266, e.g. SoftwareSerial or Serial1
     Stream    *debug_;      // -> host, e.g. Serial
     const char *indent_;      //all debug_ commands will be indented by this value
@@ -81,9 +340,107 @@ private:
     int8_t    reset_pin_;  // -1 if RST not connected
     EspStr    *host_;       // Non-NULL when TCP connection open
     boolean   writing_;
+    boolean   mux_;         // true after CIPMUX=1 (server mode)
+    uint8_t   ipd_link_;    // Link ID of the last +IPD frame
+    uint16_t  ipd_remaining_; // Data bytes of the current +IPD frame not yet read
+    uint32_t  ipd_remote_ip_; // Sender of the last +IPD frame, if AT+CIPDINFO=1
+    uint16_t  ipd_remote_port_;
+    EspLinkStats link_stats_[ESP_MAX_LINKS];
+    uint8_t   links_open_;  // Bit per server link, from "<link>,CONNECT"/"CLOSED" and +IPD
+    uint8_t   links_probed_; // Bit per link probed since it last received
+    uint32_t  link_rx_[ESP_MAX_LINKS]; // millis() when each link opened or last received
+    uint32_t  link_probe_[ESP_MAX_LINKS]; // millis() when each link in links_probed_ was probed
+    uint8_t   event_state_; // Progress through a "<link>,CONNECT"/"CLOSED" line, or an +IPD frame
+    uint8_t   event_link_;  // The event's link, or how far through an +IPD header
+    uint16_t  event_skip_;  // Data bytes left of an +IPD frame another response swallowed
+    uint32_t  keepalive_idle_;
+    uint32_t  keepalive_dead_;
+    const uint8_t *keepalive_probe_; // Sent to probe a quiet link, NULL to check AT+CIPSTATUS instead
+    uint8_t   keepalive_probe_len_;
+    EspLinkCallback link_callback_;
+    void     *link_context_;
+    int8_t    rssi_;
+    uint32_t  monitor_interval_;
+    uint32_t  last_monitor_;
+    boolean   asleep_;      // true after deepSleep() until the module is woken
+    uint32_t  wake_start_;  // millis() when wakeAndConnectTCP() started, 0 once the first send is done
+    EspWakeStats wake_stats_;
+    uint8_t   caps_;        // ESP_CAP_ flags
+    uint16_t  at_version_;  // AT firmware version as major << 8 | minor, 0 if unknown
+    boolean   passive_;     // true after AT+CIPRECVMODE=1
+    boolean   persist_ap_;  // Save the station config to flash (needed to rejoin after deep sleep)
+    EspStr   *softap_ssid_; // Soft AP started by startSoftAP(), NULL if none
+    EspStr   *softap_pass_;
+    uint8_t   softap_channel_;
+    uint32_t  command_budget_;
+    uint32_t  deadline_;    // millis() by which the current operation must finish
+    boolean   deadline_set_;    // setDeadline() was called for the next operation
+    boolean   deadline_active_; // deadline_ applies to the operation in progress
+    uint8_t   op_depth_;    // Nesting of public operations in progress
+    EspResult last_result_;
+    uint8_t   idle_strategy_;   // ESP_IDLE_ strategy used between polls
+    EspIdleCallback idle_callback_;
+    void     *idle_context_;
+    uint8_t  *tx_buf_;      // Transmit queue, NULL to write straight to stream_
+    uint16_t  tx_size_;
+    volatile uint16_t tx_head_; // Next free slot in tx_buf_
+    volatile uint16_t tx_tail_; // Next byte of tx_buf_ to send (only serviceTx() moves it)
+    boolean   tx_from_isr_; // serviceTx() is called from an interrupt, so don't call it here
+    uint8_t   tx_unsized_;  // Bytes serviceTx() writes per call, 0 to ask availableForWrite()
+    EspTxCallback tx_callback_;
+    void     *tx_context_;
+    EspBridgeStats bridge_stats_;
+    EspBaudCallback baud_callback_;
+    void     *baud_context_;
     virtual size_t write(uint8_t);
+    virtual size_t write(const uint8_t *buffer, size_t size);
+    void     writeP(const char *str, uint16_t len);
+    void     writeP(EspStr *str);
+    boolean  sendChunks(const uint8_t *data, uint16_t len, uint8_t link,
+                        const uint8_t *header, uint8_t header_len, boolean header_in_flash);
+    void     writeNumber(uint32_t value, boolean end_line = false);
+    void     queueBytes(const uint8_t *buffer, size_t size);
+    uint16_t txTail();
+    void     setTxHead(uint16_t head);
+    uint8_t  bridgeBlock(Stream *from, Stream *to, uint8_t *block);
     void     escapedDebugPrint(char* str);
     void     escapedDebugWrite(char c);
+    int      readByte(uint32_t timeout);
+    int      skipLine(uint32_t timeout);
+    int      parseNumber(int32_t *value, uint32_t timeout);
+    int      parseQuoted(char *buf, uint8_t buf_size, uint32_t timeout);
+    int      parseMac(uint8_t *mac, uint32_t timeout);
+    int      parseIp(uint32_t *ip, uint32_t timeout);
+    int      parseTag(char *tag, uint8_t tag_size, uint32_t timeout);
+    int8_t   responseEnd(const char *tag);
+    boolean  parseIpdHeader();
+    void     scanLinkEvent(uint8_t c);
+    void     linkOpened(uint8_t link);
+    void     linkClosed(uint8_t link);
+    void     linkReceived(uint8_t link);
+    int8_t   findEither(EspStr *success, EspStr *failure);
+    void     startTransmission(boolean pace);
+    void     beginMatch(EspMatch *match, EspStr *success, EspStr *failure, uint32_t timeout);
+    EspStatus stepMatch(EspMatch *match, uint16_t max_bytes);
+    uint16_t chunkSize(const EspLinkStats *stats, uint16_t len);
+    EspLinkStats *statsFor(uint8_t link);
+    void     recordSend(EspLinkStats *stats, boolean ok, uint32_t rtt);
+    void     resetLinkStats(uint8_t link);
+    boolean  waitForIP();
+    boolean  deadlinePassed();
+    uint32_t boundedTimeout(uint32_t timeout);
+    void     idle();
+    void     pause(uint32_t ms);
+    boolean  hasCap(uint8_t cap);
+    boolean  probeCommand(EspStr *query);
+    boolean  setStationMode();
+    boolean  setWifiMode(uint8_t mode);
+    void     writeWifiMode(uint8_t mode);
+    int8_t   wifiModeReply(const char *tag);
+    void     writeJoinAP(EspStr *ssid, EspStr *pass, const uint8_t *bssid);
+    void     writeSoftAP(EspStr *ssid, EspStr *pass, uint8_t channel);
+    uint8_t  stationWifiMode();
+    boolean  queryRecvLen(uint16_t *lengths);
 };
 
 #endif // SimpleESP8266_H
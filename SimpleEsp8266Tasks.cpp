@@ -0,0 +1,591 @@
+/*------------------------------------------------------------------------
+Resumable (non-blocking) versions of the SimpleESP8266 operations
+
+MIT license, all text above must be included in any redistribution.
+------------------------------------------------------------------------*/
+
+#include "SimpleEsp8266Tasks.h"
+
+EspTask::EspTask(SimpleESP8266 *esp) :
+    esp_(esp), pt_(0), status_(ESP_PENDING), t0_(0), result_(ESP_PENDING)
+{
+}
+
+// Do the next bounded piece of work.  Once the task has finished, further
+// calls keep returning its final status until restart() is called.
+EspStatus EspTask::step()
+{
+    if (result_ == ESP_PENDING)
+    {
+        if (!esp_->tx_from_isr_)
+        {
+            esp_->serviceTx();
+        }
+        result_ = run();
+    }
+    return result_;
+}
+
+EspStatus EspTask::status()
+{
+    return result_;
+}
+
+// Start the operation over from the beginning
+void EspTask::restart()
+{
+    pt_ = 0;
+    result_ = ESP_PENDING;
+}
+
+Stream *EspTask::stream()
+{
+    return esp_->stream_;
+}
+
+void EspTask::beginMatch(EspStr *success, EspStr *failure, uint32_t timeout)
+{
+    esp_->beginMatch(&match_, success, failure, timeout);
+}
+
+EspStatus EspTask::stepMatch()
+{
+    return esp_->stepMatch(&match_, ESP_TASK_STEP_BYTES);
+}
+
+void EspTask::startTransmission()
+{
+    esp_->startTransmission(false);
+}
+
+// Non-blocking clearStreamBuffer(): discards a step's worth of input.
+// Returns true once nothing is left.
+boolean EspTask::drainStep()
+{
+    for (uint8_t i = 0; i < ESP_TASK_STEP_BYTES && esp_->stream_->available(); ++i)
+    {
+        (void)esp_->stream_->read();
+    }
+    return !esp_->stream_->available();
+}
+
+void EspTask::writeBytes(const uint8_t *data, uint16_t len)
+{
+    esp_->write(data, len);
+}
+
+void EspTask::writeP(const char *str, uint16_t len)
+{
+    esp_->writeP(str, len);
+}
+
+void EspTask::writeP(EspStr *str)
+{
+    esp_->writeP(str);
+}
+
+void EspTask::writeNumber(uint32_t value, boolean end_line)
+{
+    esp_->writeNumber(value, end_line);
+}
+
+void EspTask::setMux(boolean mux)
+{
+    esp_->mux_ = mux;
+    esp_->links_open_ = 0;
+}
+
+boolean EspTask::mux()
+{
+    return esp_->mux_;
+}
+
+uint16_t EspTask::ipdRemaining()
+{
+    return esp_->ipd_remaining_;
+}
+
+void EspTask::setIpd(uint8_t link, uint16_t len)
+{
+    esp_->ipd_link_ = link;
+    esp_->ipd_remaining_ = len;
+}
+
+void EspTask::linkReceived(uint8_t link)
+{
+    esp_->linkReceived(link);
+}
+
+void EspTask::linkOpened(uint8_t link)
+{
+    esp_->linkOpened(link);
+}
+
+EspLinkStats *EspTask::statsFor(uint8_t link)
+{
+    return esp_->statsFor(link);
+}
+
+uint16_t EspTask::chunkSize(const EspLinkStats *stats, uint16_t len)
+{
+    return esp_->chunkSize(stats, len);
+}
+
+void EspTask::recordSend(EspLinkStats *stats, boolean ok, uint32_t rtt)
+{
+    esp_->recordSend(stats, ok, rtt);
+}
+
+void EspTask::resetLinkStats(uint8_t link)
+{
+    esp_->resetLinkStats(link);
+}
+
+void EspTask::setHost(EspStr *host)
+{
+    esp_->host_ = host;
+}
+
+int8_t EspTask::resetPin()
+{
+    return esp_->reset_pin_;
+}
+
+uint8_t EspTask::stationWifiMode()
+{
+    return esp_->stationWifiMode();
+}
+
+void EspTask::writeWifiMode(uint8_t mode)
+{
+    esp_->writeWifiMode(mode);
+}
+
+int8_t EspTask::wifiModeReply(const char *tag)
+{
+    return esp_->wifiModeReply(tag);
+}
+
+void EspTask::writeJoinAP(EspStr *ssid, EspStr *pass)
+{
+    esp_->writeJoinAP(ssid, pass, NULL);
+}
+
+// AT+CWSAP with the settings startSoftAP() was given
+void EspTask::writeSoftAP()
+{
+    esp_->writeSoftAP(esp_->softap_ssid_, esp_->softap_pass_, esp_->softap_channel_);
+}
+
+uint32_t EspTask::receiveTimeout()
+{
+    return esp_->receive_timeout_;
+}
+
+uint32_t EspTask::resetTimeout()
+{
+    return esp_->reset_timeout_;
+}
+
+uint32_t EspTask::connectTimeout()
+{
+    return esp_->connect_timeout_;
+}
+
+uint32_t EspTask::clientTimeout()
+{
+    return esp_->client_timeout_;
+}
+
+uint32_t EspTask::dataTimeout()
+{
+    return esp_->data_timeout_;
+}
+
+EspResetTask::EspResetTask(SimpleESP8266 *esp) :
+    EspTask(esp)
+{
+}
+
+EspStatus EspResetTask::run()
+{
+    ESP_PT_BEGIN();
+    if (resetPin() >= 0)
+    {
+        digitalWrite(resetPin(), LOW);
+        pinMode(resetPin(), OUTPUT); // Open drain; reset -> GND
+        ESP_PT_DELAY(10);            // Hold a moment
+        pinMode(resetPin(), INPUT);  // Back to high-impedance pin state
+        ESP_PT_MATCH((EspStr *)defaultBootMarker, NULL, receiveTimeout());
+        ESP_PT_DELAY(250);
+        ESP_PT_WAIT_UNTIL(drainStep());
+    }
+
+    ESP_PT_COMMAND();
+    writeP(ESP_P("AT+RST\r\n"));
+    ESP_PT_MATCH((EspStr *)defaultBootMarker, NULL, resetTimeout());
+    //Wait for any other post-boot messages
+    ESP_PT_DELAY(1000);
+    ESP_PT_WAIT_UNTIL(drainStep());
+    ESP_PT_COMMAND();
+    writeP(ESP_P("ATE0\r\n"));  // Turn off echo
+    ESP_PT_MATCH(NULL, F("ERROR"), receiveTimeout());
+    //Discard any remaining bytes (for example if it automatically connects to WiFi)
+    ESP_PT_DELAY(250);
+    ESP_PT_WAIT_UNTIL(drainStep());
+    ESP_PT_END();
+}
+
+EspConnectAPTask::EspConnectAPTask(SimpleESP8266 *esp, EspStr *ssid, EspStr *pass) :
+    EspTask(esp), ssid_(ssid), pass_(pass), tag_len_(0), read_(0)
+{
+}
+
+// Join another network, or construct without one and call this first
+void EspConnectAPTask::begin(EspStr *ssid, EspStr *pass)
+{
+    ssid_ = ssid;
+    pass_ = pass;
+    restart();
+}
+
+EspStatus EspConnectAPTask::run()
+{
+    int    c;
+    int8_t end;
+
+    ESP_PT_BEGIN();
+    ESP_PT_DELAY(250);
+    ESP_PT_WAIT_UNTIL(drainStep());
+    ESP_PT_COMMAND();
+    writeWifiMode(stationWifiMode()); // WiFi mode = Sta (and soft AP if started)
+    //The reply may be OK or "no change" (see setWifiMode()), more than one
+    //  match can look for, so read it a line at a time
+    tag_len_ = 0;
+    read_ = 0;
+    t0_ = millis();
+    for (;;)
+    {
+        ESP_PT_WAIT_UNTIL(stream()->available() || (millis() - t0_) > receiveTimeout());
+        c = stream()->read();
+        if (c < 0)
+        {
+            return ESP_ERROR;
+        }
+        t0_ = millis();
+        if (c == '\r' || c == '\n')
+        {
+            //A line too long for tag_ isn't one that ends the reply
+            if (tag_len_ > 0 && tag_len_ < sizeof(tag_))
+            {
+                tag_[tag_len_] = '\0';
+                if ((end = wifiModeReply(tag_)) >= 0)
+                {
+                    if (end == 0)
+                    {
+                        return ESP_ERROR;
+                    }
+                    break;
+                }
+            }
+            tag_len_ = 0;
+        } else if (tag_len_ < sizeof(tag_))
+        {
+            tag_[tag_len_++] = c;   //Filling the last byte marks the line as too long
+        }
+        if (++read_ % ESP_TASK_STEP_BYTES == 0)
+        {
+            ESP_PT_YIELD();
+        }
+    }
+    if (stationWifiMode() == ESP_WIFI_BOTH)
+    {
+        //The soft AP's settings may not have survived a reset
+        ESP_PT_COMMAND();
+        writeSoftAP();
+        ESP_PT_MATCH(NULL, F("ERROR"), receiveTimeout());
+    }
+    ESP_PT_COMMAND();
+    writeJoinAP(ssid_, pass_);
+    ESP_PT_MATCH(NULL, F("FAIL"), connectTimeout());
+    ESP_PT_COMMAND();
+    writeP(ESP_P("AT+CIPMUX=0\r\n"));     // Set single-client mode
+    ESP_PT_MATCH(NULL, F("ERROR"), receiveTimeout());
+    setMux(false);
+    ESP_PT_END();
+}
+
+EspAcceptTask::EspAcceptTask(SimpleESP8266 *esp, uint16_t port) :
+    EspTask(esp), port_(port), link_(0)
+{
+}
+
+EspStatus EspAcceptTask::run()
+{
+    ESP_PT_BEGIN();
+    ESP_PT_COMMAND();
+    writeP(ESP_P("AT+CIPMODE=0\r\n"));
+    ESP_PT_MATCH(NULL, F("ERROR"), receiveTimeout());
+    ESP_PT_COMMAND();
+    writeP(ESP_P("AT+CIPMUX=1\r\n"));
+    ESP_PT_MATCH(NULL, F("ERROR"), receiveTimeout());
+    setMux(true);
+    for (link_ = 0; link_ < ESP_MAX_LINKS; ++link_)
+    {
+        resetLinkStats(link_);
+    }
+    ESP_PT_COMMAND();
+    writeP(ESP_P("AT+CIPSERVER=1,"));
+    writeNumber(port_, true);
+    ESP_PT_MATCH(NULL, F("ERROR"), receiveTimeout());
+    ESP_PT_COMMAND();
+    writeP(ESP_P("AT+CIPSTO="));
+    writeNumber(clientTimeout() / 1000, true);
+    ESP_PT_MATCH(NULL, F("ERROR"), receiveTimeout());
+    ESP_PT_END();
+}
+
+EspSetupServerTask::EspSetupServerTask(SimpleESP8266 *esp, EspStr *ssid, EspStr *pass, uint16_t port) :
+    EspTask(esp), reset_(esp), connect_(esp, ssid, pass), accept_(esp, port)
+{
+}
+
+EspStatus EspSetupServerTask::run()
+{
+    ESP_PT_BEGIN();
+    ESP_PT_SPAWN(reset_);
+    ESP_PT_SPAWN(connect_);
+    // IP addr check isn't part of the library, just make sure we have one
+    ESP_PT_COMMAND();
+    writeP(ESP_P("AT+CIFSR\r\n"));
+    ESP_PT_MATCH(NULL, F("ERROR"), receiveTimeout());
+    ESP_PT_SPAWN(accept_);
+    ESP_PT_END();
+}
+
+EspConnectTCPTask::EspConnectTCPTask(SimpleESP8266 *esp, EspStr *host, int port) :
+    EspTask(esp), host_(host), port_(port)
+{
+}
+
+// Connect somewhere else, or construct without a host and call this first
+void EspConnectTCPTask::begin(EspStr *host, int port)
+{
+    host_ = host;
+    port_ = port;
+    restart();
+}
+
+EspStatus EspConnectTCPTask::run()
+{
+    ESP_PT_BEGIN();
+    ESP_PT_COMMAND();
+    writeP(ESP_P("AT+CIPSTART=\"TCP\",\""));
+    writeP(host_);
+    writeP(ESP_P("\","));
+    writeNumber(port_, true);
+    ESP_PT_MATCH(NULL, F("ERROR"), receiveTimeout());
+    setHost(host_);
+    resetLinkStats(0);
+    linkOpened(0);
+    ESP_PT_END();
+}
+
+EspRecvTask::EspRecvTask(SimpleESP8266 *esp) :
+    EspTask(esp), buffer_(NULL), buffer_len_(0), received_(0), field_(0), header_len_(0), timeout_(0)
+{
+}
+
+// timeout is how long to wait for a frame to start; 0 waits as long as
+// tcpRecv() does (the data timeout, see setTimeouts())
+void EspRecvTask::begin(char *buffer, uint32_t buffer_len, uint32_t timeout)
+{
+    buffer_ = buffer;
+    buffer_len_ = buffer_len;
+    received_ = 0;
+    timeout_ = timeout;
+    restart();
+}
+
+uint32_t EspRecvTask::length()
+{
+    return received_;
+}
+
+EspStatus EspRecvTask::run()
+{
+    int      c;
+    uint32_t to_read;
+
+    ESP_PT_BEGIN();
+    if (ipdRemaining() == 0)
+    {
+        ESP_PT_MATCH(F("+IPD,"), NULL, timeout_ ? timeout_ : dataTimeout());
+        //The match may have used this step's bytes
+        ESP_PT_YIELD();
+        //Parse "[<id>,]<len>[,<remote IP>,<remote port>]:" a byte at a time
+        field_ = 0;
+        field_value_[0] = 0;
+        field_value_[1] = 0;
+        header_len_ = 0;
+        t0_ = millis();
+        for (;;)
+        {
+            ESP_PT_WAIT_UNTIL(stream()->available() || (millis() - t0_) > receiveTimeout());
+            c = stream()->read();
+            if (c < 0 || c == ':')
+            {
+                break;
+            }
+            if (++header_len_ >= ESP_TASK_IPD_HEADER)
+            {
+                //No ':' where one should be, so this isn't a header
+                c = -1;
+                break;
+            }
+            t0_ = millis();
+            if (c == ',')
+            {
+                field_++;
+            } else if (field_ < 2 && c >= '0' && c <= '9')
+            {
+                field_value_[field_] = field_value_[field_] * 10 + (c - '0');
+            }
+            if (header_len_ % ESP_TASK_STEP_BYTES == 0)
+            {
+                ESP_PT_YIELD();
+            }
+        }
+        if (c < 0)
+        {
+            return ESP_ERROR;
+        }
+        //The link ID is only present in multiple connection mode
+        if (mux() && field_ > 0)
+        {
+            setIpd(field_value_[0], field_value_[1]);
+        } else
+        {
+            setIpd(0, field_value_[0]);
+        }
+        linkReceived(esp_->lastLinkId());
+    }
+
+    //Copy the frame's data (or as much as fits) a step's worth at a time
+    t0_ = millis();
+    while (ipdRemaining() > 0 && received_ < buffer_len_)
+    {
+        ESP_PT_WAIT_UNTIL(stream()->available() || (millis() - t0_) > receiveTimeout());
+        to_read = stream()->available();
+        if (to_read == 0)
+        {
+            //The rest of the frame never arrived, so resynchronize on the next header
+            setIpd(esp_->lastLinkId(), 0);
+            break;
+        }
+        if (to_read > ESP_TASK_STEP_BYTES)
+        {
+            to_read = ESP_TASK_STEP_BYTES;
+        }
+        if (to_read > ipdRemaining())
+        {
+            to_read = ipdRemaining();
+        }
+        if (to_read > buffer_len_ - received_)
+        {
+            to_read = buffer_len_ - received_;
+        }
+        to_read = stream()->readBytes(buffer_ + received_, to_read);
+        received_ += to_read;
+        setIpd(esp_->lastLinkId(), ipdRemaining() - to_read);
+        t0_ = millis();
+        //A chunk per step, even when more is already waiting
+        ESP_PT_YIELD();
+    }
+    //If there's room in the buffer, set the next character to null for good measure
+    if (received_ < buffer_len_)
+    {
+        buffer_[received_] = '\0';
+    }
+    ESP_PT_END();
+}
+
+EspSendTask::EspSendTask(SimpleESP8266 *esp) :
+    EspTask(esp), data_(NULL), len_(0), chunk_(0), sent_(0), link_(0), attempt_(0), t_send_(0)
+{
+}
+
+void EspSendTask::begin(const uint8_t *data, uint16_t len, uint8_t link)
+{
+    data_ = data;
+    len_ = len;
+    link_ = link;
+    restart();
+}
+
+EspStatus EspSendTask::run()
+{
+    uint16_t to_write;
+
+    ESP_PT_BEGIN();
+    while (len_ > 0)
+    {
+        for (attempt_ = 0; attempt_ < ESP_SEND_RETRIES; ++attempt_)
+        {
+            if (attempt_ > 0)
+            {
+                ESP_PT_DELAY(statsFor(link_)->retry_delay_ms);
+            }
+            //A failure shrinks the chunk, so the retry is smaller too
+            chunk_ = chunkSize(statsFor(link_), len_);
+            ESP_PT_COMMAND();
+            writeP(ESP_P("AT+CIPSEND="));
+            if (mux())
+            {
+                writeNumber(link_);
+                writeP(ESP_P(","));
+            }
+            writeNumber(chunk_, true);
+            beginMatch(F(">"), F("ERROR"), receiveTimeout());
+            ESP_PT_WAIT_UNTIL((status_ = stepMatch()) != ESP_PENDING);
+            if (status_ == ESP_ERROR)
+            {
+                //No prompt means the link itself is gone, retrying won't help
+                recordSend(statsFor(link_), false, 0);
+                return ESP_ERROR;
+            }
+            t_send_ = millis();
+            sent_ = 0;
+            while (sent_ < chunk_)
+            {
+                to_write = chunk_ - sent_;
+                if (to_write > ESP_TASK_STEP_BYTES)
+                {
+                    to_write = ESP_TASK_STEP_BYTES;
+                }
+                writeBytes(data_ + sent_, to_write);
+                sent_ += to_write;
+                if (sent_ < chunk_)
+                {
+                    ESP_PT_YIELD();
+                }
+            }
+            beginMatch(F("SEND OK\r\n"), F("SEND FAIL\r\n"), receiveTimeout());
+            ESP_PT_WAIT_UNTIL((status_ = stepMatch()) != ESP_PENDING);
+            recordSend(statsFor(link_), status_ == ESP_DONE, millis() - t_send_);
+            if (status_ == ESP_DONE || match_.timed_out)
+            {
+                //Only a SEND FAIL is retried: after a timeout the chunk may
+                //  have gone out, and a resend would duplicate it
+                break;
+            }
+        }
+        if (status_ != ESP_DONE)
+        {
+            return ESP_ERROR;
+        }
+        data_ += chunk_;
+        len_ -= chunk_;
+    }
+    ESP_PT_END();
+}
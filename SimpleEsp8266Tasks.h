@@ -0,0 +1,198 @@
+/*------------------------------------------------------------------------
+Resumable (non-blocking) versions of the SimpleESP8266 operations
+
+Each operation is a task object.  Call step() repeatedly, e.g. once per
+pass through loop(); every call does a bounded amount of work (at most
+ESP_TASK_STEP_BYTES bytes moved in either direction, never a delay) and
+returns ESP_PENDING until the operation finishes with ESP_DONE or
+ESP_ERROR.  This lets the radio share the MCU with other time-critical
+work.  Don't mix a running task with blocking calls on the same module.
+
+MIT license, all text above must be included in any redistribution.
+------------------------------------------------------------------------*/
+
+#ifndef SimpleESP8266Tasks_H
+#define SimpleESP8266Tasks_H
+#include "SimpleEsp8266.h"
+
+#define ESP_TASK_STEP_BYTES   32       //Most bytes a single step() reads or writes
+#define ESP_TASK_IPD_HEADER   32       //Longest "+IPD," header EspRecvTask reads before giving up on it
+
+// The tasks are written as protothreads: the run() body reads like the
+// blocking code, and each wait records its line number in pt_ and returns
+// ESP_PENDING.  The next step() jumps back to that line through the switch.
+// Locals don't survive a wait, so keep state in members.  Falling into the
+// next case label is the point, so it's marked for -Wimplicit-fallthrough.
+#if defined(__GNUC__) && __GNUC__ >= 7
+#define ESP_PT_FALLTHROUGH      __attribute__((fallthrough))
+#else
+#define ESP_PT_FALLTHROUGH
+#endif
+#define ESP_PT_BEGIN()          switch (pt_) { case 0:
+#define ESP_PT_END()            } return ESP_DONE
+#define ESP_PT_YIELD()          do { pt_ = __LINE__; return ESP_PENDING; case __LINE__:; } while (0)
+#define ESP_PT_WAIT_UNTIL(cond) do { pt_ = __LINE__; ESP_PT_FALLTHROUGH; case __LINE__: if (!(cond)) return ESP_PENDING; } while (0)
+#define ESP_PT_DELAY(ms)        do { t0_ = millis(); ESP_PT_WAIT_UNTIL((millis() - t0_) >= (uint32_t)(ms)); } while (0)
+// Wait for success/failure in the module's output; fail the task if failure
+// (or the timeout) comes first
+#define ESP_PT_MATCH(success, failure, timeout) do { \
+        beginMatch((success), (failure), (timeout)); \
+        ESP_PT_WAIT_UNTIL((status_ = stepMatch()) != ESP_PENDING); \
+        if (status_ == ESP_ERROR) return ESP_ERROR; \
+    } while (0)
+// Run another task to completion; fail if it fails
+#define ESP_PT_SPAWN(task) do { \
+        (task).restart(); \
+        ESP_PT_WAIT_UNTIL((status_ = (task).step()) != ESP_PENDING); \
+        if (status_ == ESP_ERROR) return ESP_ERROR; \
+    } while (0)
+// Start a command, waiting out the pacing delay without blocking
+#define ESP_PT_COMMAND() do { ESP_PT_DELAY(ESP_TX_PACE); startTransmission(); } while (0)
+
+class EspTask
+{
+public:
+    EspTask(SimpleESP8266 *esp);
+    EspStatus step();
+    EspStatus status();
+    void      restart();
+protected:
+    virtual EspStatus run() = 0;
+    //Access to the module's internals for subclasses (friendship isn't inherited)
+    Stream       *stream();
+    void          beginMatch(EspStr *success, EspStr *failure, uint32_t timeout);
+    EspStatus     stepMatch();
+    void          startTransmission();
+    boolean       drainStep();
+    void          writeBytes(const uint8_t *data, uint16_t len);
+    void          writeP(const char *str, uint16_t len);
+    void          writeP(EspStr *str);
+    void          writeNumber(uint32_t value, boolean end_line = false);
+    void          setMux(boolean mux);
+    boolean       mux();
+    uint16_t      ipdRemaining();
+    void          setIpd(uint8_t link, uint16_t len);
+    void          linkReceived(uint8_t link);
+    void          linkOpened(uint8_t link);
+    EspLinkStats *statsFor(uint8_t link);
+    uint16_t      chunkSize(const EspLinkStats *stats, uint16_t len);
+    void          recordSend(EspLinkStats *stats, boolean ok, uint32_t rtt);
+    void          resetLinkStats(uint8_t link);
+    void          setHost(EspStr *host);
+    int8_t        resetPin();
+    uint8_t       stationWifiMode();
+    void          writeWifiMode(uint8_t mode);
+    int8_t        wifiModeReply(const char *tag);
+    void          writeJoinAP(EspStr *ssid, EspStr *pass);
+    void          writeSoftAP();
+    uint32_t      receiveTimeout();
+    uint32_t      resetTimeout();
+    uint32_t      connectTimeout();
+    uint32_t      clientTimeout();
+    uint32_t      dataTimeout();
+    SimpleESP8266 *esp_;
+    uint16_t  pt_;        //Protothread continuation (line number)
+    EspStatus status_;    //Scratch for the ESP_PT_ macros
+    EspMatch  match_;
+    uint32_t  t0_;
+private:
+    EspStatus result_;    //Final status once run() stops returning ESP_PENDING
+};
+
+// hardReset() (if a reset pin was given) followed by softReset()
+class EspResetTask : public EspTask
+{
+public:
+    EspResetTask(SimpleESP8266 *esp);
+protected:
+    virtual EspStatus run();
+};
+
+// connectToAP()
+class EspConnectAPTask : public EspTask
+{
+public:
+    EspConnectAPTask(SimpleESP8266 *esp, EspStr *ssid = NULL, EspStr *pass = NULL);
+    void begin(EspStr *ssid, EspStr *pass);
+protected:
+    virtual EspStatus run();
+    EspStr *ssid_;
+    EspStr *pass_;
+    char    tag_[ESP_WIFI_MODE_TAG];  // Start of the current line of the AT+CWMODE reply
+    uint8_t tag_len_;
+    uint8_t read_;     // Bytes of the reply read, to yield every ESP_TASK_STEP_BYTES
+};
+
+// acceptTCP()
+class EspAcceptTask : public EspTask
+{
+public:
+    EspAcceptTask(SimpleESP8266 *esp, uint16_t port);
+protected:
+    virtual EspStatus run();
+    uint16_t port_;
+    uint8_t  link_;
+};
+
+// setupTcpServer()
+class EspSetupServerTask : public EspTask
+{
+public:
+    EspSetupServerTask(SimpleESP8266 *esp, EspStr *ssid, EspStr *pass, uint16_t port = 80);
+protected:
+    virtual EspStatus run();
+    EspResetTask     reset_;
+    EspConnectAPTask connect_;
+    EspAcceptTask    accept_;
+};
+
+// connectTCP()
+class EspConnectTCPTask : public EspTask
+{
+public:
+    EspConnectTCPTask(SimpleESP8266 *esp, EspStr *host = NULL, int port = 0);
+    void begin(EspStr *host, int port);
+protected:
+    virtual EspStatus run();
+    EspStr *host_;
+    int     port_;
+};
+
+// tcpRecv().  Call begin() with the buffer to fill; once done, length() is
+// the number of bytes received and lastLinkId() on the module tells which
+// connection they came from.
+class EspRecvTask : public EspTask
+{
+public:
+    EspRecvTask(SimpleESP8266 *esp);
+    void     begin(char *buffer, uint32_t buffer_len, uint32_t timeout = 0);
+    uint32_t length();
+protected:
+    virtual EspStatus run();
+    char     *buffer_;
+    uint32_t  buffer_len_;
+    uint32_t  received_;
+    uint32_t  field_value_[2];
+    uint8_t   field_;
+    uint8_t   header_len_;
+    uint32_t  timeout_;   // For the next +IPD frame, 0 for the data timeout
+};
+
+// tcpSend().  The data must stay valid until the task is done.
+class EspSendTask : public EspTask
+{
+public:
+    EspSendTask(SimpleESP8266 *esp);
+    void begin(const uint8_t *data, uint16_t len, uint8_t link = 0);
+protected:
+    virtual EspStatus run();
+    const uint8_t *data_;
+    uint16_t  len_;
+    uint16_t  chunk_;
+    uint16_t  sent_;
+    uint8_t   link_;
+    uint8_t   attempt_;
+    uint32_t  t_send_;
+};
+
+#endif // SimpleESP8266Tasks_H
@@ -0,0 +1,146 @@
+/*------------------------------------------------------------------------
+One configuration of the ESP8266 libraries, for check_footprint.sh
+
+Build with one of FOOTPRINT_SELECT_CORE, _TASKS, _MQTT, _WEBSOCKET, _LZ,
+_CAPTURE or _MULTI, and FOOTPRINT_SELECT_CLIENT or _SERVER, defined.
+Each object a budget in EspFootprint.h covers is a global named
+footprint_<feature>, so the script can find its size with avr-nm.
+
+The script also runs the sketch in simavr, with nothing on Serial1, so
+every command times out (the timeouts are cut short to keep that quick).
+After FOOTPRINT_LOOPS passes of loop() it prints espCheckFootprint() to
+Serial, whose "stack" line is the deepest the stack went, and stops the
+CPU, which ends the simulation.
+
+MIT license, all text above must be included in any redistribution.
+------------------------------------------------------------------------*/
+
+#include <SimpleEsp8266.h>
+#include <SimpleEsp8266Tasks.h>
+#include <EspFootprint.h>
+#include <avr/sleep.h>
+#if defined(FOOTPRINT_SELECT_MQTT)
+#include <EspMqtt.h>
+#elif defined(FOOTPRINT_SELECT_WEBSOCKET)
+#include <EspWebSocket.h>
+#elif defined(FOOTPRINT_SELECT_LZ)
+#include <EspLz.h>
+#elif defined(FOOTPRINT_SELECT_CAPTURE)
+#include <EspCapture.h>
+#elif defined(FOOTPRINT_SELECT_MULTI)
+#include <EspMulti.h>
+#endif
+
+static const char ssid[] PROGMEM = "ssid";
+static const char pass[] PROGMEM = "password";
+static const char host[] PROGMEM = "10.0.0.2";
+#define SSID ((EspStr *)ssid)
+#define PASS ((EspStr *)pass)
+#define HOST ((EspStr *)host)
+
+#define FOOTPRINT_LOOPS     3      //Passes of loop() before the footprint is printed
+#define FOOTPRINT_TIMEOUT   50     //Time (in milliseconds) each command waits for the module that isn't there
+
+static uint8_t data[64];
+static char    buffer[64];
+static uint8_t loops;
+
+#if defined(FOOTPRINT_SELECT_CAPTURE)
+EspCaptureStream footprint_capture(&Serial1, &Serial);
+SimpleESP8266    footprint_core(&footprint_capture);
+#else
+SimpleESP8266    footprint_core(&Serial1);
+#endif
+
+#if defined(FOOTPRINT_SELECT_TASKS)
+EspSetupServerTask footprint_tasks(&footprint_core, SSID, PASS, 80);
+#if defined(FOOTPRINT_SELECT_CLIENT)
+EspConnectTCPTask connect_task(&footprint_core, HOST, 5000);
+EspSendTask       send_task(&footprint_core);
+EspRecvTask       recv_task(&footprint_core);
+#endif
+#elif defined(FOOTPRINT_SELECT_MQTT)
+EspMqttClient footprint_mqtt(&footprint_core);
+#elif defined(FOOTPRINT_SELECT_WEBSOCKET)
+EspWebSocketServer footprint_websocket(&footprint_core);
+#elif defined(FOOTPRINT_SELECT_LZ)
+// What ESP_BUDGET_LZ covers
+struct FootprintLz
+{
+    EspLzEncoder encoder;
+    EspLzDecoder decoder;
+};
+FootprintLz footprint_lz;
+#elif defined(FOOTPRINT_SELECT_MULTI)
+// What ESP_BUDGET_MULTI covers
+struct FootprintMulti
+{
+    FootprintMulti() : module(&footprint_core) {}
+    EspMulti       multi;
+    EspMultiModule module;
+};
+FootprintMulti footprint_multi;
+#endif
+
+void setup()
+{
+    espStackPaint();
+    Serial.begin(115200);
+    Serial1.begin(115200);
+    footprint_core.setDebug(&Serial);
+    footprint_core.setTimeouts(FOOTPRINT_TIMEOUT, FOOTPRINT_TIMEOUT, FOOTPRINT_TIMEOUT,
+                               FOOTPRINT_TIMEOUT, FOOTPRINT_TIMEOUT);
+    footprint_core.setCommandBudget(FOOTPRINT_TIMEOUT);
+#if defined(FOOTPRINT_SELECT_SERVER)
+    footprint_core.setupTcpServer(SSID, PASS, 80);
+#else
+    footprint_core.connectToAP(SSID, PASS);
+    footprint_core.connectTCP(HOST, 5000);
+#endif
+#if defined(FOOTPRINT_SELECT_MQTT)
+    footprint_mqtt.connect(HOST, 1883, SSID);
+#elif defined(FOOTPRINT_SELECT_MULTI)
+    footprint_multi.multi.add(&footprint_multi.module);
+    footprint_multi.multi.begin(HOST, 5000);
+#endif
+}
+
+void loop()
+{
+#if defined(FOOTPRINT_SELECT_TASKS)
+    footprint_tasks.step();
+#if defined(FOOTPRINT_SELECT_CLIENT)
+    connect_task.step();
+    send_task.begin(data, sizeof(data));
+    send_task.step();
+    recv_task.begin(buffer, sizeof(buffer));
+    recv_task.step();
+#endif
+#elif defined(FOOTPRINT_SELECT_MQTT)
+    footprint_mqtt.loop();
+    footprint_mqtt.publish(SSID, data, sizeof(data));
+#elif defined(FOOTPRINT_SELECT_WEBSOCKET)
+    footprint_websocket.loop();
+    footprint_websocket.broadcast(data, sizeof(data));
+#elif defined(FOOTPRINT_SELECT_LZ)
+    uint16_t used;
+    uint16_t n = footprint_lz.encoder.encode(data, sizeof(data), &used, (uint8_t *)buffer, sizeof(buffer));
+    footprint_lz.decoder.decode((uint8_t *)buffer, n, &used, data, sizeof(data));
+    footprint_lz.encoder.send(&footprint_core, data, sizeof(data));
+#elif defined(FOOTPRINT_SELECT_MULTI)
+    footprint_multi.multi.loop();
+    footprint_multi.multi.send(data, sizeof(data));
+#else
+    footprint_core.tcpSend(data, sizeof(data));
+    footprint_core.tcpRecv(buffer, sizeof(buffer));
+#endif
+    if (++loops == FOOTPRINT_LOOPS)
+    {
+        espCheckFootprint(&Serial);
+        Serial.flush();
+        //Sleeping with interrupts off is how simavr knows the sketch is done
+        cli();
+        sleep_enable();
+        sleep_cpu();
+    }
+}
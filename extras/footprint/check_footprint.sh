@@ -0,0 +1,132 @@
+#!/bin/bash
+#------------------------------------------------------------------------
+# Build every configuration of the ESP8266 libraries for an AVR board and
+# check its size against the budgets
+#
+#   extras/footprint/check_footprint.sh [fqbn]
+#
+# Each feature (see FootprintCheck.ino) is built as a client and as a
+# server, with and without DEBUG_ENABLED.  For each build avr-size gives
+# the flash (text + data) and static RAM (data + bss) totals, avr-nm the
+# size of the feature's objects, and a run in simavr the deepest stack.
+# Every build's symbols, smallest to largest (avr-nm --size-sort), are
+# listed under its line.  Budgets come from the environment; unset or 0
+# means no limit:
+#
+#   FLASH_BUDGET, RAM_BUDGET      totals, per configuration
+#   ESP_BUDGET_CORE ... _MULTI    objects, as in EspFootprint.h; these are
+#                                 also passed to the compiler, so the
+#                                 library's own checks apply too
+#   ESP_BUDGET_STACK              deepest stack, per configuration
+#
+# Needs arduino-cli with the board's core installed, and avr-size, avr-nm
+# and simavr on the PATH (without simavr the stack isn't measured, which
+# fails the check if ESP_BUDGET_STACK is set).  The default board is
+# arduino:avr:mega (the sketch talks to the module on Serial1); set MCU
+# and F_CPU to match another.  Exits non-zero if any build failed or is
+# over budget.
+#
+# MIT license, all text above must be included in any redistribution.
+#------------------------------------------------------------------------
+
+here=$(cd "$(dirname "$0")" && pwd)
+lib=$(cd "$here/../.." && pwd)
+fqbn=${1:-arduino:avr:mega}
+mcu=${MCU:-atmega2560}
+f_cpu=${F_CPU:-16000000}
+sim_limit=${SIM_TIMEOUT:-120}     # Seconds a simulation may take
+work=$(mktemp -d "${TMPDIR:-/tmp}/esp_footprint.XXXXXX")
+features="CORE TASKS MQTT WEBSOCKET LZ CAPTURE MULTI"
+failed=0
+
+if command -v simavr > /dev/null; then
+    have_sim=1
+else
+    have_sim=0
+    echo "simavr not found, so the stack isn't measured"
+fi
+
+# Report an over-budget value; returns non-zero if it is
+check() # name value budget
+{
+    if [ -n "$3" ] && [ "$3" -gt 0 ] && [ "$2" -gt "$3" ]; then
+        echo "    $1 $2 is over its budget of $3"
+        return 1
+    fi
+    return 0
+}
+
+budget_flags=""
+for budget in CORE TASKS MQTT WEBSOCKET LZ CAPTURE MULTI STACK; do
+    value=$(printenv "ESP_BUDGET_$budget")
+    if [ -n "$value" ]; then
+        budget_flags="$budget_flags -DESP_BUDGET_$budget=$value"
+    fi
+done
+
+for feature in $features; do
+    for role in CLIENT SERVER; do
+        for debug in 0 1; do
+            name="${feature}_${role}_DEBUG$debug"
+            flags="-DFOOTPRINT_SELECT_$feature -DFOOTPRINT_SELECT_$role$budget_flags"
+            if [ "$debug" = 1 ]; then
+                flags="$flags -DDEBUG_ENABLED"
+            fi
+            build="$work/$name"
+            if ! arduino-cli compile --fqbn "$fqbn" --library "$lib" --build-path "$build" \
+                    --build-property "compiler.cpp.extra_flags=$flags" \
+                    "$here/FootprintCheck" > "$build.log" 2>&1; then
+                printf "%-26s build failed, see %s\n" "$name" "$build.log"
+                failed=1
+                continue
+            fi
+            elf="$build/FootprintCheck.ino.elf"
+
+            read -r text data bss <<< "$(avr-size "$elf" | awk 'NR == 2 { print $1, $2, $3 }')"
+            flash=$((text + data))
+            ram=$((data + bss))
+            #The feature's objects, e.g. footprint_core (0 if the linker dropped one)
+            core=$(avr-nm -C -S "$elf" | awk '$4 == "footprint_core" { print $2 }')
+            object=$(avr-nm -C -S "$elf" | awk -v sym="footprint_${feature,,}" '$4 == sym { print $2 }')
+            core=$((16#${core:-0}))
+            object=$((16#${object:-0}))
+
+            #The sketch prints espCheckFootprint() and then stops the CPU,
+            #  which ends the simulation
+            stack=-
+            if [ "$have_sim" = 1 ]; then
+                timeout "$sim_limit" simavr -m "$mcu" -f "$f_cpu" "$elf" > "$build.sim" 2>&1
+                stack=$(sed -n 's/.*stack  *\([0-9][0-9]*\).*/\1/p' "$build.sim" | tail -n 1)
+                if [ -z "$stack" ]; then
+                    printf "%-26s simulation didn't finish, see %s\n" "$name" "$build.sim"
+                    failed=1
+                    stack=-
+                fi
+            fi
+            printf "%-26s flash %6d  ram %5d  stack %5s  core %4d  %-9s %4d\n" \
+                "$name" "$flash" "$ram" "$stack" "$core" "${feature,,}" "$object"
+
+            check flash "$flash" "$FLASH_BUDGET" || failed=1
+            check ram "$ram" "$RAM_BUDGET" || failed=1
+            check footprint_core "$core" "$ESP_BUDGET_CORE" || failed=1
+            if [ "$feature" != CORE ]; then
+                budget_name="ESP_BUDGET_$feature"
+                check "footprint_${feature,,}" "$object" "${!budget_name}" || failed=1
+            fi
+            if [ "$stack" != - ]; then
+                check stack "$stack" "$ESP_BUDGET_STACK" || failed=1
+            elif [ -n "$ESP_BUDGET_STACK" ] && [ "$ESP_BUDGET_STACK" -gt 0 ]; then
+                echo "    stack wasn't measured, so ESP_BUDGET_STACK can't be checked"
+                failed=1
+            fi
+            avr-nm --size-sort -C -S "$elf" | sed 's/^/    /'
+        done
+    done
+done
+
+if [ "$failed" = 0 ]; then
+    rm -rf "$work"
+else
+    echo "Builds kept in $work"
+fi
+exit $failed